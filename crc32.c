@@ -12,6 +12,8 @@
 #include <endian.h>
 #include <sys/types.h>
 
+#include "fwupgrade-uboot-env.h"
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define tole(x) (x)
 #else
@@ -168,7 +170,7 @@ const uint32_t *  get_crc_table()
 /* No ones complement version. JFFS2 (and other things ?)
  * don't use ones compliment in their CRC calculations.
  */
-uint32_t crc32_no_comp(uint32_t crc, const char *buf, unsigned int len)
+uint32_t crc32_no_comp(uint32_t crc, const unsigned char *buf, unsigned int len)
 {
     const uint32_t *tab = crc_table;
     const uint32_t *b =(const uint32_t *)buf;
@@ -210,7 +212,84 @@ uint32_t crc32_no_comp(uint32_t crc, const char *buf, unsigned int len)
 }
 #undef DO_CRC
 
-uint32_t crc32 (uint32_t crc, const char *p, unsigned int len)
+uint32_t fw_crc32 (uint32_t crc, const unsigned char *p, unsigned int len)
 {
      return crc32_no_comp(crc ^ 0xffffffffL, p, len) ^ 0xffffffffL;
 }
+
+/* ========================================================================
+ * CRC combination, from zlib 1.2.12. These work on plain polynomials,
+ * so they do not depend on the byte order tables above.
+ */
+#define POLY 0xedb88320		/* p(x) reflected, with x^32 implied */
+
+/* Table of x^2^n modulo p(x), for n = 0..31 */
+static const uint32_t x2n_table[32] = {
+    0x40000000, 0x20000000, 0x08000000, 0x00800000,
+    0x00008000, 0xedb88320, 0xb1e6b092, 0xa06a2517,
+    0xed627dae, 0x88d14467, 0xd7bbfe6a, 0xec447f11,
+    0x8e7ea170, 0x6427800e, 0x4d47bae0, 0x09fe548f,
+    0x83852d0f, 0x30362f1a, 0x7b5a9cc3, 0x31fec169,
+    0x9fec022a, 0x6c8dedc4, 0x15d6874d, 0x5fde7a4e,
+    0xbad90e37, 0x2e4e5eef, 0x4eaba214, 0xa8a472c0,
+    0x429a969e, 0x148d302a, 0xc40ba6d0, 0xc4e22c3c
+};
+
+/* Return a(x) multiplied by b(x) modulo p(x) */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m, p;
+
+    m = (uint32_t)1 << 31;
+    p = 0;
+    for (;;) {
+	if (a & m) {
+	    p ^= b;
+	    if ((a & (m - 1)) == 0)
+		break;
+	}
+	m >>= 1;
+	b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+/* Return x^(n * 2^k) modulo p(x) */
+static uint32_t x2nmodp(uint64_t n, unsigned k)
+{
+    uint32_t p;
+
+    p = (uint32_t)1 << 31;	/* x^0 == 1 */
+    while (n) {
+	if (n & 1)
+	    p = multmodp(x2n_table[k & 31], p);
+	n >>= 1;
+	k++;
+    }
+    return p;
+}
+
+/*
+ * Return the operator shifting a CRC over len2 bytes, to be given to
+ * fw_crc32_combine_op(). Computing it once is worth it when many pieces
+ * of the same length are combined.
+ */
+uint32_t fw_crc32_combine_gen(uint64_t len2)
+{
+    return x2nmodp(len2, 3);
+}
+
+/* Same as fw_crc32_combine(), with the operator for len2 precomputed */
+uint32_t fw_crc32_combine_op(uint32_t crc1, uint32_t crc2, uint32_t op)
+{
+    return multmodp(op, crc1) ^ crc2;
+}
+
+/*
+ * Given crc1 = fw_crc32(0, A, len1) and crc2 = fw_crc32(0, B, len2), return
+ * the CRC of A followed by B, without going through the data again.
+ */
+uint32_t fw_crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    return multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+}
@@ -0,0 +1,285 @@
+#define _GNU_SOURCE /* for asprintf */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fwupgrade-cache.h"
+
+/*
+ * On-disk cache of part digests, so that unchanged parts are not
+ * hashed again when an image is rebuilt. A digest is reused when the
+ * file still has the same path, device, inode, size and modification
+ * time. The cache is a text file with one entry per line:
+ *
+ *   md5 device inode size mtime-seconds mtime-nanoseconds path
+ */
+struct fwcache_entry {
+	char     crc[FWPART_CRC_SZ];
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t  mtime_sec;
+	long     mtime_nsec;
+	char    *path;
+};
+
+struct fwcache {
+	char                 *filename;
+	pthread_mutex_t       lock;
+	struct fwcache_entry *entries;
+	unsigned int          count;
+	int                   dirty;
+};
+
+/*
+ * A file modified less than this many seconds before it was hashed
+ * might be modified again without its modification time changing, on
+ * filesystems with a coarse timestamp granularity. Its digest is not
+ * cached.
+ */
+#define FWCACHE_RACY_SECONDS 2
+
+static struct fwcache_entry *fwcache_find(struct fwcache *cache,
+					  const char *path)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->count; i++)
+		if (! strcmp(cache->entries[i].path, path))
+			return & cache->entries[i];
+
+	return NULL;
+}
+
+static int fwcache_add(struct fwcache *cache, const struct fwcache_entry *entry)
+{
+	struct fwcache_entry *tmp;
+
+	tmp = realloc(cache->entries, (cache->count + 1) * sizeof(*tmp));
+	if (! tmp)
+		return -1;
+
+	cache->entries = tmp;
+	cache->entries[cache->count] = *entry;
+	cache->entries[cache->count].path = strdup(entry->path);
+	if (! cache->entries[cache->count].path)
+		return -1;
+
+	cache->count++;
+	return 0;
+}
+
+static int hex_to_crc(const char *hex, char crc[FWPART_CRC_SZ])
+{
+	unsigned int i, byte;
+
+	if (strlen(hex) != 2 * FWPART_CRC_SZ)
+		return -1;
+
+	for (i = 0; i < FWPART_CRC_SZ; i++) {
+		if (sscanf(hex + 2 * i, "%2x", & byte) != 1)
+			return -1;
+		crc[i] = byte;
+	}
+
+	return 0;
+}
+
+/*
+ * Load the cache from filename. A missing or partly invalid file is
+ * not an error: the invalid entries are ignored, and the file is
+ * created or rewritten by fwcache_save().
+ */
+struct fwcache *fwcache_load(const char *filename)
+{
+	struct fwcache *cache;
+	struct fwcache_entry entry;
+	char *line = NULL;
+	size_t linesz = 0;
+	FILE *f;
+
+	cache = calloc(1, sizeof(*cache));
+	if (! cache)
+		return NULL;
+
+	cache->filename = strdup(filename);
+	if (! cache->filename) {
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_init(& cache->lock, NULL);
+
+	f = fopen(filename, "r");
+	if (! f)
+		return cache;
+
+	while (getline(& line, & linesz, f) > 0) {
+		char hex[2 * FWPART_CRC_SZ + 1];
+		unsigned long long dev, ino, size;
+		long long sec;
+		int pathpos;
+
+		line[strcspn(line, "\n")] = '\0';
+
+		if (sscanf(line, "%32s %llu %llu %llu %lld %ld %n", hex, & dev,
+			   & ino, & size, & sec, & entry.mtime_nsec,
+			   & pathpos) != 6 ||
+		    hex_to_crc(hex, entry.crc) || ! line[pathpos])
+			continue;
+
+		entry.dev       = dev;
+		entry.ino       = ino;
+		entry.size      = size;
+		entry.mtime_sec = sec;
+		entry.path      = line + pathpos;
+
+		if (! fwcache_find(cache, entry.path) && fwcache_add(cache, & entry))
+			break;
+	}
+
+	free(line);
+	fclose(f);
+
+	return cache;
+}
+
+/*
+ * Look up the digest of the file at path, whose current attributes
+ * are st. Returns 1 and fills crc on a hit, 0 otherwise.
+ */
+int fwcache_lookup(struct fwcache *cache, const char *path,
+		   const struct stat *st, char crc[FWPART_CRC_SZ])
+{
+	struct fwcache_entry *entry;
+	char *fullpath;
+	int ret = 0;
+
+	fullpath = realpath(path, NULL);
+	if (! fullpath)
+		return 0;
+
+	pthread_mutex_lock(& cache->lock);
+
+	entry = fwcache_find(cache, fullpath);
+	if (entry &&
+	    entry->dev == st->st_dev &&
+	    entry->ino == st->st_ino &&
+	    entry->size == st->st_size &&
+	    entry->mtime_sec == st->st_mtim.tv_sec &&
+	    entry->mtime_nsec == st->st_mtim.tv_nsec) {
+		memcpy(crc, entry->crc, FWPART_CRC_SZ);
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(& cache->lock);
+	free(fullpath);
+
+	return ret;
+}
+
+/* Record the digest of the file at path, whose attributes are st */
+void fwcache_store(struct fwcache *cache, const char *path,
+		   const struct stat *st, const char crc[FWPART_CRC_SZ])
+{
+	struct fwcache_entry *entry, new;
+	char *fullpath;
+
+	if (st->st_mtim.tv_sec + FWCACHE_RACY_SECONDS > time(NULL))
+		return;
+
+	fullpath = realpath(path, NULL);
+	if (! fullpath)
+		return;
+
+	memcpy(new.crc, crc, FWPART_CRC_SZ);
+	new.dev        = st->st_dev;
+	new.ino        = st->st_ino;
+	new.size       = st->st_size;
+	new.mtime_sec  = st->st_mtim.tv_sec;
+	new.mtime_nsec = st->st_mtim.tv_nsec;
+	new.path       = fullpath;
+
+	pthread_mutex_lock(& cache->lock);
+
+	entry = fwcache_find(cache, fullpath);
+	if (entry) {
+		new.path = entry->path;
+		*entry = new;
+		cache->dirty = 1;
+	} else if (! fwcache_add(cache, & new))
+		cache->dirty = 1;
+
+	pthread_mutex_unlock(& cache->lock);
+	free(fullpath);
+}
+
+/*
+ * Write the cache back if it changed. The new contents are written to
+ * a temporary file renamed over the old one, so that an interrupted
+ * build never leaves a truncated cache behind.
+ */
+int fwcache_save(struct fwcache *cache)
+{
+	char *tmpname;
+	unsigned int i, j;
+	FILE *f;
+
+	if (! cache->dirty)
+		return 0;
+
+	if (asprintf(& tmpname, "%s.tmp", cache->filename) < 0)
+		return -1;
+
+	f = fopen(tmpname, "w");
+	if (! f) {
+		free(tmpname);
+		return -1;
+	}
+
+	for (i = 0; i < cache->count; i++) {
+		struct fwcache_entry *entry = & cache->entries[i];
+
+		for (j = 0; j < FWPART_CRC_SZ; j++)
+			fprintf(f, "%02x", (unsigned char) entry->crc[j]);
+
+		fprintf(f, " %llu %llu %llu %lld %ld %s\n",
+			(unsigned long long) entry->dev,
+			(unsigned long long) entry->ino,
+			(unsigned long long) entry->size,
+			(long long) entry->mtime_sec, entry->mtime_nsec,
+			entry->path);
+	}
+
+	if (fclose(f) || rename(tmpname, cache->filename)) {
+		unlink(tmpname);
+		free(tmpname);
+		return -1;
+	}
+
+	free(tmpname);
+	cache->dirty = 0;
+
+	return 0;
+}
+
+void fwcache_release(struct fwcache *cache)
+{
+	unsigned int i;
+
+	if (! cache)
+		return;
+
+	for (i = 0; i < cache->count; i++)
+		free(cache->entries[i].path);
+
+	pthread_mutex_destroy(& cache->lock);
+	free(cache->entries);
+	free(cache->filename);
+	free(cache);
+}
@@ -0,0 +1,18 @@
+#ifndef __FWUPGRADE_CACHE_H__
+#define __FWUPGRADE_CACHE_H__
+
+#include <sys/stat.h>
+
+#include "fwupgrade.h"
+
+struct fwcache;
+
+struct fwcache *fwcache_load(const char *filename);
+int fwcache_lookup(struct fwcache *cache, const char *path,
+		   const struct stat *st, char crc[FWPART_CRC_SZ]);
+void fwcache_store(struct fwcache *cache, const char *path,
+		   const struct stat *st, const char crc[FWPART_CRC_SZ]);
+int fwcache_save(struct fwcache *cache);
+void fwcache_release(struct fwcache *cache);
+
+#endif /* __FWUPGRADE_CACHE_H__ */
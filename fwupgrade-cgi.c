@@ -1,43 +1,515 @@
+#define _GNU_SOURCE /* for memmem and strcasestr */
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
 
 #include "fwupgrade-cgi.h"
 
 #define VALID_CONTENT_TYPE "multipart/form-data; boundary="
 #define VALID_ELEMENT_CONTENT_DISPOSITION "Content-Disposition:"
-#define VALID_ELEMENT_CONTENT_TYPE "Content-Type: application/octet-stream"
+#define VALID_RAW_CONTENT_TYPE "application/octet-stream"
+
+/* Size of the reads of a raw upload */
+#define RAW_CHUNK_SZ (256 * 1024)
+
+/* Size of the window over a multipart body, which must hold the
+   headers of an element */
+#define MULTIPART_BUF_SZ (256 * 1024)
+
+/* Maximum length of a multipart boundary, from RFC 2046 */
+#define MULTIPART_BOUNDARY_SZ 70
+
+/* Size of the compressed data read at once */
+#define DECODE_IN_SZ (64 * 1024)
+
+enum {
+	CGI_ENCODING_IDENTITY,
+	CGI_ENCODING_GZIP,
+	CGI_ENCODING_ZSTD,
+};
+
+/*
+ * The body of the request, read from stdin and decoded according to
+ * its Content-Encoding
+ */
+struct cgi_body {
+	long long           length;      /* from CONTENT_LENGTH, or -1 */
+	long long           remaining;   /* bytes left, or -1 */
+	int                 chunked;
+	unsigned long long  chunk_left;  /* bytes left in the chunk */
+	int                 chunk_end;   /* a chunk end is expected */
+	int                 eof;
+	int                 encoding;    /* CGI_ENCODING_* */
+	char               *in;          /* compressed data read ahead */
+	size_t              in_start, in_end;
+	int                 decoded_end;
+#ifdef WITH_ZLIB
+	z_stream            zs;
+#endif
+#ifdef WITH_ZSTD
+	ZSTD_DStream       *zds;
+#endif
+};
+
+struct cgi_multipart {
+	struct cgi_body  body;
+	char            *buf;
+	size_t           start, end;     /* of the data not looked at yet */
+	char             delim[MULTIPART_BOUNDARY_SZ + 5];
+	size_t           delim_len;
+};
+
+static int cgi_enabled;
+static int cgi_http;
+static int cgi_status_sent;
+
+/*
+ * Start answering a request: as a CGI, or with a plain HTTP response
+ * when http is set, for the requests served by the daemon
+ */
+void fwupgrade_cgi_init(int http)
+{
+	cgi_enabled = 1;
+	cgi_http = http;
+}
+
+/*
+ * Send the CGI response headers with the given HTTP status. Only the
+ * first call has an effect: the headers are sent as late as possible
+ * so that a request can still be rejected with an error status once
+ * the beginning of the image has been checked. Does nothing when not
+ * running as a CGI.
+ */
+void fwupgrade_cgi_status(int status)
+{
+	fwupgrade_cgi_status_type(status, "text/plain");
+}
 
-static char *nextline(char *s, unsigned int *remaining)
+/* Same as fwupgrade_cgi_status, for a response of the given type */
+void fwupgrade_cgi_status_type(int status, const char *type)
 {
-	/* Go to the end of line */
-	while (*s != '\n' && *s != '\r' && *s != 0) {
-		(*remaining)--;
-		s++;
+	const char *reason;
+
+	if (! cgi_enabled || cgi_status_sent)
+		return;
+
+	switch (status) {
+	case 200: reason = "OK"; break;
+	case 400: reason = "Bad Request"; break;
+	case 405: reason = "Method Not Allowed"; break;
+	case 409: reason = "Conflict"; break;
+	case 411: reason = "Length Required"; break;
+	case 413: reason = "Payload Too Large"; break;
+	case 415: reason = "Unsupported Media Type"; break;
+	case 416: reason = "Range Not Satisfiable"; break;
+	case 417: reason = "Expectation Failed"; break;
+	case 507: reason = "Insufficient Storage"; break;
+	default:  reason = "Internal Server Error"; status = 500; break;
 	}
 
-	if (! *s)
-		return NULL;
+	if (cgi_http) {
+		printf("HTTP/1.1 %d %s\r\n", status, reason);
+		printf("Content-Type: %s\r\n", type);
+		printf("Connection: close\r\n\r\n");
+	} else {
+		printf("Status: %d %s\n", status, reason);
+		printf("Content-type: %s\n\n", type);
+	}
+	cgi_status_sent = 1;
+}
 
-	if (*s == '\r') {
-		(*remaining)--;
-		s++;
+/*
+ * Copy the value of the name parameter of the query string to value,
+ * truncated to size. Returns 0 if the parameter is there, with or
+ * without a value, or -1.
+ */
+int fwupgrade_cgi_query(const char *name, char *value, size_t size)
+{
+	char *query = getenv("QUERY_STRING");
+	size_t name_len = strlen(name), len;
+	const char *p;
+
+	if (! query)
+		return -1;
+
+	for (p = query; p; p = strchr(p, '&')) {
+		if (*p == '&')
+			p++;
+		if (! strncmp(p, name, name_len) &&
+		    (p[name_len] == '=' || p[name_len] == '&' ||
+		     p[name_len] == '\0'))
+			break;
 	}
-	else
-		return NULL;
 
-	if (*s == '\n') {
-		(*remaining)--;
-		s++;
+	if (! p)
+		return -1;
+
+	p += name_len;
+	if (*p == '=')
+		p++;
+
+	len = strcspn(p, "&");
+	if (len >= size)
+		len = size - 1;
+
+	memcpy(value, p, len);
+	value[len] = '\0';
+
+	return 0;
+}
+
+static void cgi_error(int status, const char *fmt, ...)
+{
+	va_list ap;
+
+	fwupgrade_cgi_status(status);
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Checks done on the request headers alone, before any of the body is
+ * read. When the client sent "Expect: 100-continue", the web server
+ * only tells it to send the body once the CGI starts reading it, so a
+ * request rejected here never transfers its body.
+ */
+static int cgi_check_expect(void)
+{
+	char *expect = getenv("HTTP_EXPECT");
+
+	if (expect && strcasecmp(expect, "100-continue")) {
+		cgi_error(417, "ERROR: unsupported expectation %s, aborting.\n",
+			  expect);
+		return -1;
 	}
-	else
-		return NULL;
 
-	return s;
+	return 0;
 }
 
-static char *get_filename_from_content_disposition(char *buf)
+/*
+ * Tell the client to send the body, once the request has passed the
+ * checks done on its headers. A web server does it for a CGI, the
+ * daemon leaves it to the request handler.
+ */
+static int cgi_continue(void)
+{
+	char *expect = getenv("HTTP_EXPECT");
+	char *protocol = getenv("SERVER_PROTOCOL");
+
+	if (! cgi_http || cgi_status_sent || ! expect ||
+	    (protocol && ! strcmp(protocol, "HTTP/1.0")))
+		return 0;
+
+	printf("HTTP/1.1 100 Continue\r\n\r\n");
+
+	return fflush(stdout) ? -1 : 0;
+}
+
+/*
+ * Read a line of a chunked body into line, dropping what does not fit.
+ * Returns the length of the line without its line ending, or -1 at the
+ * end of file.
+ */
+static int cgi_read_chunk_line(char *line, int size)
+{
+	int c, len = 0;
+
+	while ((c = getchar()) != EOF) {
+		if (c == '\n') {
+			if (len > 0 && line[len - 1] == '\r')
+				len--;
+			line[len] = '\0';
+			return len;
+		}
+		if (len < size - 1)
+			line[len++] = c;
+	}
+
+	return -1;
+}
+
+/*
+ * Read the raw body: up to CONTENT_LENGTH, up to the end of file when
+ * there is no length, or up to the last chunk of a chunked body, as
+ * some web servers hand it to CGIs unchanged. Returns the number of
+ * bytes read, 0 at the end of the body, or -1 once the error has been
+ * reported.
+ */
+static ssize_t cgi_body_read_raw(struct cgi_body *b, char *buf, size_t len)
+{
+	char line[128], *end;
+	ssize_t n;
+
+	if (b->eof)
+		return 0;
+
+	if (! b->chunked) {
+		if (b->remaining >= 0) {
+			if (! b->remaining) {
+				b->eof = 1;
+				return 0;
+			}
+			if ((unsigned long long) b->remaining < len)
+				len = b->remaining;
+		}
+
+		do
+			n = read(STDIN_FILENO, buf, len);
+		while (n < 0 && errno == EINTR);
+
+		if (n < 0) {
+			cgi_error(400, "ERROR: could not read the upload, aborting.\n");
+			return -1;
+		}
+		if (n == 0) {
+			if (b->remaining < 0) {
+				b->eof = 1;
+				return 0;
+			}
+			cgi_error(400, "ERROR: could not read the complete %lld bytes, aborting.\n",
+				  b->length);
+			return -1;
+		}
+
+		if (b->remaining >= 0)
+			b->remaining -= n;
+
+		return n;
+	}
+
+	if (! b->chunk_left) {
+		/* Each chunk ends with an empty line */
+		if (b->chunk_end && cgi_read_chunk_line(line, sizeof(line)) != 0) {
+			cgi_error(400, "ERROR: invalid chunk end, aborting.\n");
+			return -1;
+		}
+		b->chunk_end = 0;
+
+		if (cgi_read_chunk_line(line, sizeof(line)) < 0)
+			goto truncated;
+
+		b->chunk_left = strtoull(line, &end, 16);
+		if (end == line || (*end && *end != ';' && *end != ' ')) {
+			cgi_error(400, "ERROR: invalid chunk size, aborting.\n");
+			return -1;
+		}
+
+		/* Skip the trailers, up to the final empty line */
+		if (! b->chunk_left) {
+			while (cgi_read_chunk_line(line, sizeof(line)) > 0)
+				;
+			b->eof = 1;
+			return 0;
+		}
+	}
+
+	if (len > b->chunk_left)
+		len = b->chunk_left;
+
+	n = fread(buf, 1, len, stdin);
+	if (! n)
+		goto truncated;
+
+	b->chunk_left -= n;
+	if (! b->chunk_left)
+		b->chunk_end = 1;
+
+	return n;
+
+truncated:
+	cgi_error(400, "ERROR: truncated chunked upload, aborting.\n");
+	return -1;
+}
+
+/*
+ * Decode some of the compressed data read ahead into buf. Returns the
+ * number of bytes decoded, possibly 0 when more input is needed, or -1
+ * on error.
+ */
+static ssize_t cgi_body_decode(struct cgi_body *b, char *buf, size_t len)
+{
+	ssize_t n = -1;
+
+	switch (b->encoding) {
+#ifdef WITH_ZLIB
+	case CGI_ENCODING_GZIP: {
+		int ret;
+
+		b->zs.next_in   = (unsigned char *) b->in + b->in_start;
+		b->zs.avail_in  = b->in_end - b->in_start;
+		b->zs.next_out  = (unsigned char *) buf;
+		b->zs.avail_out = len;
+
+		ret = inflate(& b->zs, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+			b->decoded_end = 1;
+		else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			cgi_error(400, "ERROR: invalid gzip data, aborting.\n");
+			return -1;
+		}
+
+		b->in_start = b->in_end - b->zs.avail_in;
+		n = len - b->zs.avail_out;
+		break;
+	}
+#endif
+#ifdef WITH_ZSTD
+	case CGI_ENCODING_ZSTD: {
+		ZSTD_inBuffer in = { b->in + b->in_start,
+				     b->in_end - b->in_start, 0 };
+		ZSTD_outBuffer out = { buf, len, 0 };
+		size_t ret;
+
+		ret = ZSTD_decompressStream(b->zds, & out, & in);
+		if (ZSTD_isError(ret)) {
+			cgi_error(400, "ERROR: invalid zstd data, aborting.\n");
+			return -1;
+		}
+
+		/* 0 once the frame is complete and flushed */
+		if (! ret)
+			b->decoded_end = 1;
+
+		b->in_start += in.pos;
+		n = out.pos;
+		break;
+	}
+#endif
+	}
+
+	return n;
+}
+
+/*
+ * Read the body, decoded according to its Content-Encoding, through a
+ * buffer of compressed data of bounded size. Returns the number of
+ * bytes read, 0 at the end of the body, or -1 once the error has been
+ * reported.
+ */
+static ssize_t cgi_body_read(struct cgi_body *b, char *buf, size_t len)
+{
+	ssize_t n;
+
+	if (b->encoding == CGI_ENCODING_IDENTITY)
+		return cgi_body_read_raw(b, buf, len);
+
+	/* Data after the end of the compressed stream is ignored */
+	while (! b->decoded_end) {
+		if (b->in_start == b->in_end && ! b->eof) {
+			n = cgi_body_read_raw(b, b->in, DECODE_IN_SZ);
+			if (n < 0)
+				return -1;
+			b->in_start = 0;
+			b->in_end = n;
+		}
+
+		n = cgi_body_decode(b, buf, len);
+		if (n)
+			return n;
+
+		if (b->eof && b->in_start == b->in_end && ! b->decoded_end) {
+			cgi_error(400, "ERROR: truncated compressed upload, aborting.\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void cgi_body_close(struct cgi_body *b)
+{
+#ifdef WITH_ZLIB
+	if (b->encoding == CGI_ENCODING_GZIP)
+		inflateEnd(& b->zs);
+#endif
+#ifdef WITH_ZSTD
+	ZSTD_freeDStream(b->zds);
+#endif
+	free(b->in);
+	b->in = NULL;
+}
+
+/*
+ * Get ready to read the body, from the length, transfer and content
+ * encodings of the request.
+ */
+static int cgi_body_open(struct cgi_body *b)
+{
+	char *content_length, *transfer, *encoding, *end;
+
+	memset(b, 0, sizeof(*b));
+	b->length = -1;
+
+	content_length = getenv("CONTENT_LENGTH");
+	if (content_length && *content_length) {
+		b->length = strtoll(content_length, &end, 10);
+		if (*end || b->length < 0) {
+			cgi_error(400, "ERROR: incorrect length\n");
+			return -1;
+		}
+	}
+	b->remaining = b->length;
+
+	/* A server that decodes the chunks sets CONTENT_LENGTH or just
+	   closes stdin at the end of the body */
+	transfer = getenv("HTTP_TRANSFER_ENCODING");
+	if (b->length < 0 && transfer && strcasestr(transfer, "chunked"))
+		b->chunked = 1;
+
+	encoding = getenv("HTTP_CONTENT_ENCODING");
+	if (! encoding || ! *encoding || ! strcasecmp(encoding, "identity"))
+		return 0;
+
+#ifdef WITH_ZLIB
+	/* Both gzip and zlib headers are accepted */
+	if (! strcasecmp(encoding, "gzip") || ! strcasecmp(encoding, "x-gzip") ||
+	    ! strcasecmp(encoding, "deflate")) {
+		if (inflateInit2(& b->zs, 32 + MAX_WBITS) != Z_OK)
+			goto nomem;
+		b->encoding = CGI_ENCODING_GZIP;
+	}
+#endif
+#ifdef WITH_ZSTD
+	if (! strcasecmp(encoding, "zstd")) {
+		b->zds = ZSTD_createDStream();
+		if (! b->zds || ZSTD_isError(ZSTD_initDStream(b->zds)))
+			goto nomem;
+		b->encoding = CGI_ENCODING_ZSTD;
+	}
+#endif
+
+	if (b->encoding == CGI_ENCODING_IDENTITY) {
+		cgi_error(415, "ERROR: unsupported content encoding %s, aborting.\n",
+			  encoding);
+		return -1;
+	}
+
+	b->in = malloc(DECODE_IN_SZ);
+	if (b->in)
+		return 0;
+
+#if defined(WITH_ZLIB) || defined(WITH_ZSTD)
+nomem:
+#endif
+	cgi_body_close(b);
+	cgi_error(500, "ERROR: memory allocation problem, aborting.\n");
+	return -1;
+}
+
+static char *get_param_from_content_disposition(char *buf, const char *param)
 {
 	char *p, *psave;
 	char *localbuf, *tmp;
@@ -58,7 +530,8 @@ static char *get_filename_from_content_disposition(char *buf)
 	tmp = localbuf;
 
 	/* This parses a string like 'form-data; name="file";
-	 * filename="foobar.img"' and extracts 'foobar.img' */
+	 * filename="foobar.img"' and extracts 'foobar.img' for the
+	 * filename parameter */
 	while((p = strtok_r(tmp, ";", &psave)) != NULL) {
 		char *delim;
 
@@ -83,7 +556,7 @@ static char *get_filename_from_content_disposition(char *buf)
 				value++;
 			}
 
-			if (! strcmp(name, "filename")) {
+			if (! strcmp(name, param)) {
 				free(localbuf);
 				return strdup(value);
 			}
@@ -97,165 +570,291 @@ static char *get_filename_from_content_disposition(char *buf)
 	return NULL;
 }
 
-char *fwupgrade_cgi_receive_data(unsigned int *length_out)
+/* Read more of the body, after what is left in mp->buf */
+static int cgi_multipart_fill(struct cgi_multipart *mp)
+{
+	ssize_t n;
+
+	memmove(mp->buf, mp->buf + mp->start, mp->end - mp->start);
+	mp->end -= mp->start;
+	mp->start = 0;
+
+	if (mp->end == MULTIPART_BUF_SZ)
+		return 0;
+
+	n = cgi_body_read(& mp->body, mp->buf + mp->end,
+			  MULTIPART_BUF_SZ - mp->end);
+	if (n > 0)
+		mp->end += n;
+
+	return n;
+}
+
+/*
+ * Parse the MIME headers of an element, up to the empty line, and hand
+ * them to the begin callback
+ */
+static int cgi_multipart_begin(char *headers, size_t len,
+			       const struct fwupgrade_cgi_element_ops *ops,
+			       void *ctx)
+{
+	char *line, *next, *name = NULL, *filename = NULL, *end;
+	long long length = -1;
+	int ret = -1;
+
+	/* Each line, including the last one, ends with \r\n */
+	headers[len] = '\0';
+
+	for (line = headers; *line; line = next) {
+		next = strstr(line, "\r\n");
+		if (! next)
+			break;
+		next += 2;
+
+		if (! strncasecmp(line, VALID_ELEMENT_CONTENT_DISPOSITION,
+				  strlen(VALID_ELEMENT_CONTENT_DISPOSITION))) {
+			name = get_param_from_content_disposition(line, "name");
+			filename = get_param_from_content_disposition(line,
+								     "filename");
+		} else if (! strncasecmp(line, "Content-Length:", 15)) {
+			length = strtoll(line + 15, &end, 10);
+			if (*end != '\r' || length < 0)
+				length = -1;
+		}
+	}
+
+	if (! name) {
+		cgi_error(400, "ERROR: cannot find Content-Disposition in element\n");
+		goto out;
+	}
+
+	ret = ops->begin(ctx, name, filename, length);
+
+out:
+	free(name);
+	free(filename);
+	return ret;
+}
+
+/*
+ * Receive a multipart/form-data upload, as sent by index.html or by a
+ * web UI with several file fields, and hand each element to ops as it
+ * is read from stdin. Nothing is kept in memory but the part of the
+ * body being looked at for the next boundary.
+ */
+int fwupgrade_cgi_receive_multipart(const struct fwupgrade_cgi_element_ops *ops,
+				    void *ctx)
 {
-	char *method;
-	char *content_type;
-	char *content_length;
-	long length, length_read;
-	char *buffer = NULL;
-	char *boundary = NULL, *boundary_start, *data, *cur;
-	unsigned int boundary_len, data_len, remaining;
-	int boundary_found;
-	char *filename;
+	enum { PREAMBLE, DELIMITER, HEADERS, DATA } state = PREAMBLE;
+	struct cgi_multipart mp;
+	char *method, *content_type, *boundary_start;
+	char *p;
+	size_t avail, n;
+	int elements = 0;
+	int ret = -1;
+
+	memset(& mp, 0, sizeof(mp));
 
 	method = getenv("REQUEST_METHOD");
 	if (! method) {
-		printf("ERROR: incorrect REQUEST_METHOD, aborting.\n");
-		goto error;
+		cgi_error(400, "ERROR: incorrect REQUEST_METHOD, aborting.\n");
+		return -1;
 	}
 
 	if (strcasecmp(method, "post")) {
-		printf("ERROR: incorrect HTTP method, aborting.\n");
-		goto error;
+		cgi_error(405, "ERROR: incorrect HTTP method, aborting.\n");
+		return -1;
 	}
 
+	if (cgi_check_expect())
+		return -1;
+
 	content_type = getenv("CONTENT_TYPE");
 	if (! content_type) {
-		printf("ERROR: no content type, aborting.\n");
-		goto error;
-	}
-
-	content_length = getenv("CONTENT_LENGTH");
-	if (! content_length) {
-		printf("ERROR: no content length, aborting.\n");
-		goto error;
+		cgi_error(415, "ERROR: no content type, aborting.\n");
+		return -1;
 	}
 
 	/* Verify that we have a supported content type */
 	if (strncasecmp(content_type, VALID_CONTENT_TYPE,
 			strlen(VALID_CONTENT_TYPE))) {
-		printf("ERROR: unsupported content type %s, aborting.\n",
-		       content_type);
-		goto error;
+		cgi_error(415, "ERROR: unsupported content type %s, aborting.\n",
+			  content_type);
+		return -1;
 	}
 
-	boundary_start = strchr(content_type, '=');
-	if (! boundary_start) {
-		printf("ERROR: cannot find boundary delimiter, aborting.\n");
-		goto error;
+	boundary_start = strchr(content_type, '=') + 1;
+	if (! *boundary_start || strlen(boundary_start) > MULTIPART_BOUNDARY_SZ) {
+		cgi_error(400, "ERROR: cannot find boundary delimiter, aborting.\n");
+		return -1;
 	}
 
-	/* Skip the '=' character */
-	boundary_start += 1;
+	/* The line break before a delimiter belongs to it. One is added
+	   before the body, so that the first delimiter looks the same
+	   as the others. */
+	mp.delim_len = snprintf(mp.delim, sizeof(mp.delim), "\r\n--%s",
+				boundary_start);
 
-	boundary_len = 2 + strlen(boundary_start);
-	boundary = malloc(boundary_len + 1);
-	if (! boundary) {
-		printf("ERROR: memory allocation problem, aborting.\n");
-		goto error;
-	}
+	if (cgi_body_open(& mp.body))
+		return -1;
 
-	snprintf(boundary, boundary_len + 1, "--%s", boundary_start);
+	if (cgi_continue())
+		goto out;
 
-	length = strtol(content_length, NULL, 10);
-	if (length == LONG_MIN || length == LONG_MAX) {
-		printf("ERROR: incorrect length\n");
-		goto error;
+	mp.buf = malloc(MULTIPART_BUF_SZ + 1);
+	if (! mp.buf) {
+		cgi_error(500, "ERROR: memory allocation problem, aborting.\n");
+		goto out;
 	}
 
-	buffer = malloc(length);
-	if (! buffer) {
-		printf("ERROR: memory allocation problem, aborting.\n");
-		goto error;
-	}
+	memcpy(mp.buf, "\r\n", 2);
+	mp.end = 2;
+
+	for (;;) {
+		avail = mp.end - mp.start;
+
+		switch (state) {
+		case PREAMBLE:
+		case DATA:
+			p = memmem(mp.buf + mp.start, avail, mp.delim, mp.delim_len);
+			n = p ? p - (mp.buf + mp.start) :
+				avail > mp.delim_len ? avail - mp.delim_len + 1 : 0;
+
+			if (state == DATA && n &&
+			    ops->data(ctx, mp.buf + mp.start, n))
+				goto out;
+			mp.start += n;
+
+			if (! p)
+				break;
+
+			if (state == DATA && ops->end(ctx))
+				goto out;
+
+			mp.start += mp.delim_len;
+			state = DELIMITER;
+			continue;
+
+		case DELIMITER:
+			if (avail < 2)
+				break;
+
+			/* The last delimiter is followed by -- */
+			if (! strncmp(mp.buf + mp.start, "--", 2)) {
+				if (! elements) {
+					cgi_error(400, "ERROR: cannot find data in firmware image\n");
+					goto out;
+				}
+				ret = 0;
+				goto out;
+			}
 
-	length_read = fread(buffer, 1, length, stdin);
-	if (length_read != length) {
-		printf("ERROR: could not read the complete %ld bytes, aborting.\n", length);
-		goto error;
-	}
+			/* Transport padding may follow the delimiter */
+			p = memmem(mp.buf + mp.start, avail, "\r\n", 2);
+			if (! p)
+				break;
+
+			mp.start = p + 2 - mp.buf;
+			state = HEADERS;
+			continue;
+
+		case HEADERS:
+			p = memmem(mp.buf + mp.start, avail, "\r\n\r\n", 4);
+			if (! p) {
+				if (avail == MULTIPART_BUF_SZ) {
+					cgi_error(400, "ERROR: element headers too long, aborting.\n");
+					goto out;
+				}
+				break;
+			}
 
-	remaining = length;
-	cur       = buffer;
+			n = p + 2 - (mp.buf + mp.start);
+			if (cgi_multipart_begin(mp.buf + mp.start, n, ops, ctx))
+				goto out;
+			elements++;
 
-	/* The data should start with the boundary delimiter */
-	if (strncmp(boundary, cur, boundary_len)) {
-		printf("ERROR: cannot find boundary delimiter in data, aborting.\n");
-		goto error;
+			mp.start += n + 2;
+			state = DATA;
+			continue;
+		}
+
+		/* More data is needed to go on */
+		switch (cgi_multipart_fill(& mp)) {
+		case -1:
+			goto out;
+		case 0:
+			cgi_error(400, "ERROR: cannot find boundary\n");
+			goto out;
+		}
 	}
 
-	cur = nextline(cur, & remaining);
+out:
+	free(mp.buf);
+	cgi_body_close(& mp.body);
+	return ret;
+}
 
-	/* Check that we have a Content-Disposition line */
-	if (strncmp(cur, VALID_ELEMENT_CONTENT_DISPOSITION,
-		    strlen(VALID_ELEMENT_CONTENT_DISPOSITION))) {
-		printf("ERROR: cannot find Content-Disposition in element\n");
-		goto error;
-	}
+/*
+ * Whether the request carries the raw image as its body, rather than
+ * a multipart/form-data form as sent by index.html.
+ */
+int fwupgrade_cgi_raw_upload(void)
+{
+	char *content_type = getenv("CONTENT_TYPE");
 
-	filename = get_filename_from_content_disposition(cur);
+	return content_type &&
+		! strncasecmp(content_type, VALID_RAW_CONTENT_TYPE,
+			      strlen(VALID_RAW_CONTENT_TYPE));
+}
 
-	cur = nextline(cur, & remaining);
+/*
+ * Receive a raw image, POSTed or PUT as application/octet-stream, and
+ * hand it to feed piece by piece as it is read from stdin, without
+ * keeping it in memory. The length does not have to be known: without
+ * CONTENT_LENGTH, the body is read up to the end of file, and decoded
+ * if the web server passes a chunked body through. A compressed body
+ * is decompressed on the fly. Whether the image is complete is up to
+ * the consumer. Returns 0 once the whole body has been fed.
+ */
+int fwupgrade_cgi_receive_stream(fwupgrade_cgi_feed feed, void *ctx)
+{
+	struct cgi_body body;
+	char *method, *buffer = NULL;
+	ssize_t n;
+	int ret = -1;
 
-	/* Check that we have a Content-Type line */
-	if (strncmp(cur, VALID_ELEMENT_CONTENT_TYPE,
-		    strlen(VALID_ELEMENT_CONTENT_TYPE))) {
-		printf("ERROR: cannot find Content-Type in element\n");
-		goto error;
+	method = getenv("REQUEST_METHOD");
+	if (! method ||
+	    (strcasecmp(method, "post") && strcasecmp(method, "put"))) {
+		cgi_error(405, "ERROR: incorrect HTTP method, aborting.\n");
+		return -1;
 	}
 
-	/* Skip all lines until we find an empty line */
-	while((cur = nextline(cur, & remaining)) != NULL) {
-		if (cur[0] == '\r' && cur[1] == '\n') {
-			cur = nextline(cur, & remaining);
-			break;
-		}
-	}
+	if (cgi_check_expect())
+		return -1;
 
-	if (cur == NULL) {
-		printf("ERROR: cannot find data in firmware image\n");
-		goto error;
-	}
+	if (cgi_body_open(& body))
+		return -1;
 
-	/* The real data starts here */
-	data = cur;
-
-	data_len = 0;
-	boundary_found = 0;
-	while(remaining >= boundary_len) {
-		/* Have we reached the boundary, which marks the end
-		   of the data ? */
-		if (! strncmp(cur, boundary, boundary_len)) {
-			if (! strncmp(data + data_len - 2, "\r\n", 2))
-				data_len -= 2;
-			boundary_found = 1;
-			break;
-		}
+	if (cgi_continue())
+		goto out;
 
-		data_len ++;
-		cur      ++;
-		remaining --;
+	buffer = malloc(RAW_CHUNK_SZ);
+	if (! buffer) {
+		cgi_error(500, "ERROR: memory allocation problem, aborting.\n");
+		goto out;
 	}
 
-	if (! boundary_found) {
-		printf("ERROR: cannot find boundary\n");
-		goto error;
+	while ((n = cgi_body_read(& body, buffer, RAW_CHUNK_SZ)) > 0) {
+		if (feed(ctx, buffer, n))
+			goto out;
 	}
 
-	printf("Received image file '%s' of %d bytes\n",
-	       filename, data_len);
-
-	/* Move the useful data at the beginning of the buffer, so
-	   that the beginning of the data is 4 bytes aligned */
-	memmove(buffer, data, data_len);
-	*length_out = data_len;
-	free(boundary);
+	if (n == 0)
+		ret = 0;
 
-	return buffer;
-
-error:
+out:
 	free(buffer);
-	free(boundary);
-	return NULL;
+	cgi_body_close(& body);
+	return ret;
 }
@@ -1,6 +1,40 @@
 #ifndef __FWUPGRADE_CGI_H__
 #define __FWUPGRADE_CGI_H__
 
-char *fwupgrade_cgi_receive_data(unsigned int *length_out);
+#include <stddef.h>
+
+/*
+ * Called with the beginning of the image, returns 0 if it is
+ * acceptable, -1 to reject it, or the number of bytes needed to
+ * decide
+ */
+typedef int (*fwupgrade_cgi_check)(const char *data, size_t len);
+
+void fwupgrade_cgi_init(int http);
+void fwupgrade_cgi_status(int status);
+void fwupgrade_cgi_status_type(int status, const char *type);
+int fwupgrade_cgi_query(const char *name, char *value, size_t size);
+
+/* Called with each piece of a streamed upload, returns 0 to go on */
+typedef int (*fwupgrade_cgi_feed)(void *ctx, const char *data, size_t len);
+
+/*
+ * Called for each element of a multipart upload: begin with its field
+ * name, its file name or NULL, and its length or -1 when unknown, data
+ * with its content, and end once it is complete. Each returns 0 to go
+ * on.
+ */
+struct fwupgrade_cgi_element_ops {
+	int (*begin)(void *ctx, const char *name, const char *filename,
+		     long long length);
+	fwupgrade_cgi_feed data;
+	int (*end)(void *ctx);
+};
+
+int fwupgrade_cgi_receive_multipart(const struct fwupgrade_cgi_element_ops *ops,
+				    void *ctx);
+
+int fwupgrade_cgi_raw_upload(void);
+int fwupgrade_cgi_receive_stream(fwupgrade_cgi_feed feed, void *ctx);
 
 #endif /* __FWUPGRADE_CGI_H__ */
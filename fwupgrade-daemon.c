@@ -0,0 +1,536 @@
+#define _GNU_SOURCE /* for clearenv */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fwupgrade-daemon.h"
+
+/*
+ * Long-running upgrade server. It listens on a Unix socket, used by
+ * fwupgrade-cgi, and optionally on a TCP port, and speaks a minimal
+ * HTTP/1.1 on both: one request per connection, with the body read
+ * up to Content-Length, the end of a chunked body, or the end of file.
+ *
+ * Each connection is served by a child forked from the daemon, with
+ * the request turned into CGI variables and the connection as stdin
+ * and stdout, so that the upgrade code runs exactly as in the CGI but
+ * without the start-up cost: the configuration and the bad block maps
+ * are already loaded.
+ *
+ * Nothing authenticates the requests, and any of them may flash an
+ * image and reboot the device, so the TCP port only listens on the
+ * loopback interface unless another address is given.
+ */
+
+/* Maximum size of the request line and headers */
+#define REQUEST_HEAD_SZ 8192
+
+/* Response of the daemon being relayed by fwupgrade-cgi */
+struct daemon_client {
+	char   head[4096];
+	size_t head_len;
+	int    head_done;
+};
+
+extern char **environ;
+
+static int daemon_listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s too long\n", path);
+		return -1;
+	}
+
+	memset(& addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Cannot create socket");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) & addr, sizeof(addr)) ||
+	    listen(fd, 8)) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", path,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int daemon_listen_tcp(const char *address, int port)
+{
+	struct sockaddr_in addr;
+	int fd, one = 1;
+
+	memset(& addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, & addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid address %s\n", address);
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Cannot create socket");
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, & one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) & addr, sizeof(addr)) ||
+	    listen(fd, 8)) {
+		fprintf(stderr, "Cannot listen on %s port %d: %s\n", address,
+			port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Read the request line and headers, one byte at a time so that the
+ * body is left untouched for the upgrade code. Returns the length of
+ * the head, including its final empty line, or -1.
+ */
+static int daemon_read_head(int fd, char *head, size_t size)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < size - 1) {
+		n = read(fd, head + len, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		len++;
+		if (len >= 4 && ! memcmp(head + len - 4, "\r\n\r\n", 4)) {
+			head[len] = '\0';
+			return len;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Turn a request head into the CGI variables that the upgrade code
+ * expects. Returns 0, or -1 if the request is malformed. An "Expect:
+ * 100-continue" header is passed on as well: the upgrade code sends
+ * the interim response itself, once the request has passed the checks
+ * done before reading the body.
+ */
+static int daemon_set_cgi_env(char *head)
+{
+	char *line, *next, *method, *target, *version, *query, *value;
+	char name[128];
+	size_t i;
+
+	next = strstr(head, "\r\n");
+	*next = '\0';
+	next += 2;
+
+	method = strtok(head, " ");
+	target = strtok(NULL, " ");
+	version = strtok(NULL, " ");
+	if (! method || ! target || ! version || strncmp(version, "HTTP/1.", 7))
+		return -1;
+
+	setenv("REQUEST_METHOD", method, 1);
+	setenv("SERVER_PROTOCOL", version, 1);
+
+	query = strchr(target, '?');
+	setenv("QUERY_STRING", query ? query + 1 : "", 1);
+
+	for (line = next; ; line = next) {
+		next = strstr(line, "\r\n");
+		if (next == line)
+			break;
+		*next = '\0';
+		next += 2;
+
+		value = strchr(line, ':');
+		if (! value || value == line)
+			return -1;
+		*value++ = '\0';
+		while (*value == ' ' || *value == '\t')
+			value++;
+
+		if (! strcasecmp(line, "Content-Type")) {
+			setenv("CONTENT_TYPE", value, 1);
+			continue;
+		}
+
+		if (! strcasecmp(line, "Content-Length")) {
+			setenv("CONTENT_LENGTH", value, 1);
+			continue;
+		}
+
+		if (strlen(line) + 6 > sizeof(name))
+			continue;
+
+		strcpy(name, "HTTP_");
+		for (i = 0; line[i]; i++)
+			name[5 + i] = line[i] == '-' ? '_' : toupper(line[i]);
+		name[5 + i] = '\0';
+
+		setenv(name, value, 1);
+	}
+
+	return 0;
+}
+
+static void daemon_serve(int conn, fwupgrade_daemon_handler handler)
+{
+	static const char bad_request[] =
+		"HTTP/1.1 400 Bad Request\r\n"
+		"Content-Type: text/plain\r\n"
+		"Connection: close\r\n\r\n"
+		"ERROR: malformed request, aborting.\n";
+	char head[REQUEST_HEAD_SZ];
+	char *path = getenv("PATH");
+
+	/* Only the variables of this request are seen by the upgrade
+	   code */
+	path = path ? strdup(path) : NULL;
+	clearenv();
+	if (path)
+		setenv("PATH", path, 1);
+
+	if (daemon_read_head(conn, head, sizeof(head)) < 0 ||
+	    daemon_set_cgi_env(head)) {
+		if (write(conn, bad_request, sizeof(bad_request) - 1) < 0)
+			perror("Cannot answer request");
+		exit(1);
+	}
+
+	if (dup2(conn, STDIN_FILENO) < 0 || dup2(conn, STDOUT_FILENO) < 0)
+		exit(1);
+	close(conn);
+
+	exit(handler() ? 1 : 0);
+}
+
+/*
+ * Serve upgrade requests on the Unix socket at socket_path and, if
+ * port is not 0, on that TCP port of the IPv4 address. handler serves one request, in a
+ * child process, with the request as CGI variables and the connection
+ * as stdin and stdout. refresh, if not NULL, is called whenever a
+ * child has failed, as the state inherited by the next ones, such as
+ * the bad block maps, may then be out of date. Only returns on error.
+ */
+int fwupgrade_daemon_run(const char *socket_path, const char *address,
+			 int port,
+			 fwupgrade_daemon_handler handler,
+			 void (*refresh)(void))
+{
+	struct pollfd fds[2];
+	int nfds = 0, conn, i, status;
+	pid_t pid;
+
+	fds[nfds].fd = daemon_listen_unix(socket_path);
+	if (fds[nfds].fd < 0)
+		return -1;
+	fds[nfds++].events = POLLIN;
+
+	if (port) {
+		fds[nfds].fd = daemon_listen_tcp(address, port);
+		if (fds[nfds].fd < 0)
+			return -1;
+		fds[nfds++].events = POLLIN;
+	}
+
+	/* A client going away is reported by write() */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		/* Wake up once in a while to reap the children */
+		if (poll(fds, nfds, 1000) < 0 && errno != EINTR) {
+			perror("poll");
+			return -1;
+		}
+
+		while ((pid = waitpid(-1, & status, WNOHANG)) > 0) {
+			if (refresh && (! WIFEXITED(status) ||
+					WEXITSTATUS(status)))
+				refresh();
+		}
+
+		for (i = 0; i < nfds; i++) {
+			if (! (fds[i].revents & POLLIN))
+				continue;
+
+			conn = accept4(fds[i].fd, NULL, NULL, SOCK_CLOEXEC);
+			if (conn < 0)
+				continue;
+
+			fflush(stdout);
+			fflush(stderr);
+
+			pid = fork();
+			if (pid == 0) {
+				close(fds[0].fd);
+				if (nfds > 1)
+					close(fds[1].fd);
+				daemon_serve(conn, handler);
+			}
+
+			if (pid < 0)
+				perror("fork");
+			close(conn);
+		}
+	}
+}
+
+/*
+ * Send all of data to fd. Returns 0, or -1 once the peer has gone
+ * away.
+ */
+static int daemon_write_full(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Send the CGI request as an HTTP request head to the daemon */
+static int daemon_send_head(int fd)
+{
+	char head[REQUEST_HEAD_SZ], *method, *query, *value, *eq;
+	size_t len;
+	char **env;
+	int i;
+
+	method = getenv("REQUEST_METHOD");
+	query = getenv("QUERY_STRING");
+
+	len = snprintf(head, sizeof(head), "%s /%s%s HTTP/1.1\r\n",
+		       method ? method : "GET", query && *query ? "?" : "",
+		       query ? query : "");
+
+	value = getenv("CONTENT_TYPE");
+	if (value && len < sizeof(head))
+		len += snprintf(head + len, sizeof(head) - len,
+				"Content-Type: %s\r\n", value);
+
+	value = getenv("CONTENT_LENGTH");
+	if (value && *value && len < sizeof(head))
+		len += snprintf(head + len, sizeof(head) - len,
+				"Content-Length: %s\r\n", value);
+
+	/* The web server has already dealt with the connection and the
+	   100-continue expectation */
+	for (env = environ; *env && len < sizeof(head); env++) {
+		if (strncmp(*env, "HTTP_", 5) ||
+		    ! strncmp(*env, "HTTP_EXPECT=", 12) ||
+		    ! strncmp(*env, "HTTP_CONNECTION=", 16))
+			continue;
+
+		eq = strchr(*env, '=');
+		if (! eq)
+			continue;
+
+		for (i = 5; *env + i < eq && len < sizeof(head); i++)
+			head[len++] = (*env)[i] == '_' ? '-' : (*env)[i];
+		if (len < sizeof(head))
+			len += snprintf(head + len, sizeof(head) - len,
+					": %s\r\n", eq + 1);
+	}
+
+	if (len < sizeof(head))
+		len += snprintf(head + len, sizeof(head) - len,
+				"Connection: close\r\n\r\n");
+
+	if (len >= sizeof(head)) {
+		fprintf(stderr, "Request headers too long\n");
+		return -1;
+	}
+
+	return daemon_write_full(fd, head, len);
+}
+
+/*
+ * Copy the response of the daemon to stdout, turning its status line
+ * into a CGI Status header. Returns 0 once the response is complete.
+ */
+static int daemon_relay_response(struct daemon_client *c,
+				 const char *data, size_t len)
+{
+	char *end, *line, *next, *p;
+	size_t from, copy;
+
+	if (c->head_done)
+		return daemon_write_full(STDOUT_FILENO, data, len);
+
+	/* The terminator may straddle two reads */
+	from = c->head_len > 3 ? c->head_len - 3 : 0;
+
+	copy = len;
+	if (copy > sizeof(c->head) - 1 - c->head_len)
+		copy = sizeof(c->head) - 1 - c->head_len;
+	memcpy(c->head + c->head_len, data, copy);
+	c->head[c->head_len + copy] = '\0';
+
+	end = strstr(c->head + from, "\r\n\r\n");
+	if (! end) {
+		c->head_len += copy;
+		return c->head_len == sizeof(c->head) - 1 ? -1 : 0;
+	}
+
+	/* Only the head is kept, the body that came with it follows */
+	copy = end + 4 - (c->head + c->head_len);
+	c->head_len += copy;
+	c->head[c->head_len] = '\0';
+	data += copy;
+	len -= copy;
+
+	/* "HTTP/1.1 200 OK" becomes "Status: 200 OK", and the
+	   connection is the business of the web server */
+	next = strstr(c->head, "\r\n") + 2;
+	p = strchr(c->head, ' ');
+	if (! p || p > next)
+		return -1;
+
+	c->head_done = 1;
+
+	if (daemon_write_full(STDOUT_FILENO, "Status:", 7) ||
+	    daemon_write_full(STDOUT_FILENO, p, next - p))
+		return -1;
+
+	for (line = next; line < end + 4; line = next) {
+		next = strstr(line, "\r\n") + 2;
+		if (! strncasecmp(line, "Connection:", 11))
+			continue;
+		if (daemon_write_full(STDOUT_FILENO, line, next - line))
+			return -1;
+	}
+
+	return daemon_write_full(STDOUT_FILENO, data, len);
+}
+
+/*
+ * Hand the CGI request on stdin to the daemon listening on
+ * socket_path, and its response back to stdout. Returns -1 without
+ * doing anything if the daemon cannot be reached, so that the caller
+ * can serve the request itself, 1 if the request failed, 0 otherwise.
+ */
+int fwupgrade_daemon_forward(const char *socket_path)
+{
+	static const char bad_gateway[] =
+		"Status: 502 Bad Gateway\n"
+		"Content-type: text/plain\n\n"
+		"ERROR: no answer from the upgrade daemon, aborting.\n";
+	struct daemon_client client;
+	struct sockaddr_un addr;
+	struct pollfd fds[2];
+	char buf[64 * 1024];
+	int fd, stdin_open = 1;
+	ssize_t n;
+
+	memset(& addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *) & addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(& client, 0, sizeof(client));
+
+	if (daemon_send_head(fd))
+		goto error;
+
+	/* The daemon may answer before it has read the whole body, when
+	   it rejects the image early */
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = STDIN_FILENO;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, stdin_open ? 2 : 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			goto error;
+		}
+
+		if (fds[0].revents) {
+			n = read(fd, buf, sizeof(buf));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			if (daemon_relay_response(& client, buf, n))
+				goto error;
+			continue;
+		}
+
+		if (stdin_open && fds[1].revents) {
+			n = read(STDIN_FILENO, buf, sizeof(buf));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0 || daemon_write_full(fd, buf, n)) {
+				/* The end of the body, for a request
+				   without length */
+				shutdown(fd, SHUT_WR);
+				stdin_open = 0;
+			}
+		}
+	}
+
+	close(fd);
+
+	if (client.head_done)
+		return 0;
+
+	daemon_write_full(STDOUT_FILENO, bad_gateway, sizeof(bad_gateway) - 1);
+	return 1;
+
+error:
+	close(fd);
+	if (! client.head_done)
+		daemon_write_full(STDOUT_FILENO, bad_gateway,
+				  sizeof(bad_gateway) - 1);
+	return 1;
+}
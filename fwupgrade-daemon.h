@@ -0,0 +1,16 @@
+#ifndef __FWUPGRADE_DAEMON_H__
+#define __FWUPGRADE_DAEMON_H__
+
+/* Default address of the TCP port, only reachable locally */
+#define FWUPGRADE_DAEMON_ADDRESS "127.0.0.1"
+
+/* Serves one request, returns 0 on success */
+typedef int (*fwupgrade_daemon_handler)(void);
+
+int fwupgrade_daemon_run(const char *socket_path, const char *address,
+			 int port,
+			 fwupgrade_daemon_handler handler,
+			 void (*refresh)(void));
+int fwupgrade_daemon_forward(const char *socket_path);
+
+#endif /* __FWUPGRADE_DAEMON_H__ */
@@ -6,10 +6,11 @@
 
 #include "fwupgrade-file.h"
 
-char *fwupgrade_load_file_data(const char *filename, unsigned int *length_out)
+char *fwupgrade_load_file_data(const char *filename, size_t *length_out)
 {
 	int fd;
 	struct stat st;
+	void *data;
 
 	if (! filename)
 		return NULL;
@@ -18,8 +19,16 @@ char *fwupgrade_load_file_data(const char *filename, unsigned int *length_out)
 	if (fd < 0)
 		return NULL;
 
-	if (fstat(fd, &st))
+	if (fstat(fd, &st)) {
+		close(fd);
 		return NULL;
+	}
 
-	return mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	*length_out = st.st_size;
+	return data;
 }
@@ -1,6 +1,8 @@
 #ifndef __FWUPGRADE_FILE_H__
 #define __FWUPGRADE_FILE_H__
 
-char *fwupgrade_load_file_data(const char *filename, unsigned int *length_out);
+#include <stddef.h>
+
+char *fwupgrade_load_file_data(const char *filename, size_t *length_out);
 
 #endif /* __FWUPGRADE_CGI_H__ */
@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <mtd/mtd-user.h>
+#include <mtd/ubi-user.h>
+
+#include "fwupgrade-flash.h"
+
+/*
+ * Bad block map of one MTD device. Each block is queried with
+ * MEMGETBADBLOCK at most once during the lifetime of the process: the
+ * "known" bitmap tells which entries of the "bad" bitmap are valid.
+ */
+struct flash_bbt {
+	dev_t             rdev;
+	unsigned char     type;
+	unsigned int      erasesize;
+	unsigned int      nblocks;
+	unsigned char    *known;
+	unsigned char    *bad;
+	struct flash_bbt *next;
+};
+
+static struct flash_bbt *bbt_list;
+static pthread_mutex_t bbt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define BBT_TEST(map, i)  ((map)[(i) / 8] & (1 << ((i) % 8)))
+#define BBT_SET(map, i)   ((map)[(i) / 8] |= (1 << ((i) % 8)))
+#define BBT_CLEAR(map, i) ((map)[(i) / 8] &= ~(1 << ((i) % 8)))
+
+static struct flash_bbt *flash_bbt_get(int fd)
+{
+	struct flash_bbt *bbt;
+	struct mtd_info_user info;
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return NULL;
+
+	for (bbt = bbt_list; bbt; bbt = bbt->next)
+		if (bbt->rdev == st.st_rdev)
+			return bbt;
+
+	if (ioctl(fd, MEMGETINFO, &info) < 0)
+		return NULL;
+
+	bbt = calloc(1, sizeof(*bbt));
+	if (! bbt)
+		return NULL;
+
+	bbt->rdev      = st.st_rdev;
+	bbt->type      = info.type;
+	bbt->erasesize = info.erasesize;
+	bbt->nblocks   = info.size / info.erasesize;
+	bbt->known     = calloc(1, (bbt->nblocks + 7) / 8);
+	bbt->bad       = calloc(1, (bbt->nblocks + 7) / 8);
+	if (! bbt->known || ! bbt->bad) {
+		free(bbt->known);
+		free(bbt->bad);
+		free(bbt);
+		return NULL;
+	}
+
+	bbt->next = bbt_list;
+	bbt_list = bbt;
+
+	return bbt;
+}
+
+/*
+ * Test whether the block at offset is bad, using the cached bad block
+ * map of the device. Returns 0 if the block is good, > 0 if it is bad
+ * and < 0 if it could not be tested. Only NAND has bad blocks.
+ */
+int flash_block_isbad(int fd, loff_t offset)
+{
+	struct flash_bbt *bbt;
+	unsigned int block;
+	int ret;
+
+	pthread_mutex_lock(&bbt_lock);
+
+	bbt = flash_bbt_get(fd);
+	if (! bbt) {
+		perror("Cannot read bad block map");
+		ret = -1;
+		goto out;
+	}
+
+	ret = 0;
+	if (bbt->type != MTD_NANDFLASH)
+		goto out;
+
+	block = offset / bbt->erasesize;
+	if (block >= bbt->nblocks) {
+		ret = -1;
+		goto out;
+	}
+
+	if (BBT_TEST(bbt->known, block)) {
+		ret = BBT_TEST(bbt->bad, block) ? 1 : 0;
+		goto out;
+	}
+
+	ret = ioctl(fd, MEMGETBADBLOCK, &offset);
+	if (ret < 0) {
+		perror("Cannot read bad block mark");
+		goto out;
+	}
+
+	BBT_SET(bbt->known, block);
+	if (ret) {
+		BBT_SET(bbt->bad, block);
+		ret = 1;
+	}
+
+out:
+	pthread_mutex_unlock(&bbt_lock);
+	return ret;
+}
+
+/*
+ * Mark the block at offset bad after a failed erase or write. The
+ * cached state of the block is dropped, so that the next test asks
+ * the kernel again.
+ */
+int flash_block_markbad(int fd, loff_t offset)
+{
+	struct flash_bbt *bbt;
+	int ret;
+
+	ret = ioctl(fd, MEMSETBADBLOCK, &offset);
+	if (ret < 0)
+		perror("Cannot mark block bad");
+
+	pthread_mutex_lock(&bbt_lock);
+	bbt = flash_bbt_get(fd);
+	if (bbt && offset / bbt->erasesize < bbt->nblocks)
+		BBT_CLEAR(bbt->known, offset / bbt->erasesize);
+	pthread_mutex_unlock(&bbt_lock);
+
+	return ret;
+}
+
+/*
+ * Read the whole bad block map of an MTD partition, replacing what was
+ * known about it. A long-running process calls it ahead of time so
+ * that the children it forks start with a complete map.
+ */
+int flash_bbt_scan(const char *part)
+{
+	struct flash_bbt *bbt;
+	char devname[64];
+	unsigned int block;
+	loff_t offset;
+	int fd, ret = 0;
+
+	snprintf(devname, sizeof(devname), "/dev/%s", part);
+	fd = open(devname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	pthread_mutex_lock(&bbt_lock);
+	bbt = flash_bbt_get(fd);
+	if (bbt)
+		memset(bbt->known, 0, (bbt->nblocks + 7) / 8);
+	pthread_mutex_unlock(&bbt_lock);
+
+	if (! bbt) {
+		close(fd);
+		return -1;
+	}
+
+	for (block = 0; block < bbt->nblocks; block++) {
+		offset = (loff_t) block * bbt->erasesize;
+		if (flash_block_isbad(fd, offset) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	close(fd);
+	return ret;
+}
+
+/*
+ * Writer for a raw MTD partition. Data is gathered one erase block at
+ * a time, each block is erased right before being programmed and bad
+ * blocks are skipped, like "flash_erase" followed by "nandwrite -p"
+ * would do. Blocks left after the data are erased when closing.
+ *
+ * The same writer also updates UBI volumes, in which case the data is
+ * handed to the volume character device as is, like "ubiupdatevol"
+ * would do.
+ */
+struct flash_writer {
+	int                   fd;
+	int                   ubi;
+	char                  devname[64];
+	struct mtd_info_user  info;
+	loff_t                blockstart;
+	char                 *block;
+	size_t                fill;
+	unsigned int          bad_blocks;   /* skipped or marked bad */
+};
+
+struct flash_writer *flash_writer_open_mtd(const char *part)
+{
+	struct flash_writer *w;
+
+	w = calloc(1, sizeof(*w));
+	if (! w)
+		return NULL;
+
+	snprintf(w->devname, sizeof(w->devname), "/dev/%s", part);
+
+	w->fd = open(w->devname, O_RDWR);
+	if (w->fd < 0) {
+		printf("ERROR: Cannot open %s: %s\n", w->devname, strerror(errno));
+		free(w);
+		return NULL;
+	}
+
+	if (ioctl(w->fd, MEMGETINFO, &w->info) < 0) {
+		printf("ERROR: Cannot get MTD information for %s: %s\n",
+		       w->devname, strerror(errno));
+		goto error;
+	}
+
+	w->block = malloc(w->info.erasesize);
+	if (! w->block) {
+		printf("ERROR: memory allocation problem, aborting.\n");
+		goto error;
+	}
+
+	return w;
+
+error:
+	close(w->fd);
+	free(w);
+	return NULL;
+}
+
+/*
+ * Start the update of a UBI volume with size bytes. The volume is
+ * empty until that many bytes have been written.
+ */
+struct flash_writer *flash_writer_open_ubi(const char *volume, uint64_t size)
+{
+	struct flash_writer *w;
+	int64_t bytes = size;
+
+	w = calloc(1, sizeof(*w));
+	if (! w)
+		return NULL;
+
+	w->ubi = 1;
+	snprintf(w->devname, sizeof(w->devname), "/dev/ubi/%s", volume);
+
+	w->fd = open(w->devname, O_RDWR);
+	if (w->fd < 0) {
+		printf("ERROR: Cannot open %s: %s\n", w->devname, strerror(errno));
+		free(w);
+		return NULL;
+	}
+
+	if (ioctl(w->fd, UBI_IOCVOLUP, &bytes) < 0) {
+		printf("ERROR: Cannot start the update of %s: %s\n",
+		       w->devname, strerror(errno));
+		close(w->fd);
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+static int flash_writer_ubi(struct flash_writer *w, const char *data,
+			    size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(w->fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			printf("ERROR: Write failure on %s: %s\n", w->devname,
+			       strerror(n < 0 ? errno : EIO));
+			return -1;
+		}
+		data += n;
+		len  -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Erase the next good block and program len bytes of data in it. len
+ * must be a multiple of the write size. Returns 0 on success.
+ */
+static int flash_writer_block(struct flash_writer *w, const char *data,
+			      size_t len)
+{
+	struct erase_info_user erase;
+	int ret;
+
+	while (w->blockstart < w->info.size) {
+		ret = flash_block_isbad(w->fd, w->blockstart);
+		if (ret < 0)
+			return -1;
+
+		if (ret) {
+			w->blockstart += w->info.erasesize;
+			w->bad_blocks++;
+			continue;
+		}
+
+		erase.start  = w->blockstart;
+		erase.length = w->info.erasesize;
+
+		if (ioctl(w->fd, MEMERASE, &erase) < 0) {
+			printf("ERROR: Erase failure at 0x%llx on %s: %s\n",
+			       (unsigned long long) w->blockstart, w->devname,
+			       strerror(errno));
+			if (w->info.type != MTD_NANDFLASH)
+				return -1;
+			flash_block_markbad(w->fd, w->blockstart);
+			w->blockstart += w->info.erasesize;
+			w->bad_blocks++;
+			continue;
+		}
+
+		if (len && pwrite(w->fd, data, len, w->blockstart) != len) {
+			printf("ERROR: Write failure at 0x%llx on %s: %s\n",
+			       (unsigned long long) w->blockstart, w->devname,
+			       strerror(errno));
+			if (w->info.type != MTD_NANDFLASH)
+				return -1;
+
+			/* Retry the same data in the next block */
+			ioctl(w->fd, MEMERASE, &erase);
+			flash_block_markbad(w->fd, w->blockstart);
+			w->blockstart += w->info.erasesize;
+			w->bad_blocks++;
+			continue;
+		}
+
+		w->blockstart += w->info.erasesize;
+		return 0;
+	}
+
+	/* Running out of blocks only matters if there is data left */
+	if (! len)
+		return 0;
+
+	printf("ERROR: Not enough good blocks on %s\n", w->devname);
+	return -1;
+}
+
+int flash_writer_write(struct flash_writer *w, const char *data, size_t len)
+{
+	size_t n;
+
+	if (w->ubi)
+		return flash_writer_ubi(w, data, len);
+
+	while (len) {
+		/* Full blocks are programmed straight from the caller's buffer */
+		if (w->fill == 0 && len >= w->info.erasesize) {
+			if (flash_writer_block(w, data, w->info.erasesize))
+				return -1;
+			data += w->info.erasesize;
+			len  -= w->info.erasesize;
+			continue;
+		}
+
+		n = w->info.erasesize - w->fill;
+		if (n > len)
+			n = len;
+
+		memcpy(w->block + w->fill, data, n);
+		w->fill += n;
+		data    += n;
+		len     -= n;
+
+		if (w->fill == w->info.erasesize) {
+			if (flash_writer_block(w, w->block, w->fill))
+				return -1;
+			w->fill = 0;
+		}
+	}
+
+	return 0;
+}
+
+/* Number of bad blocks met so far, including the ones marked bad */
+unsigned int flash_writer_bad_blocks(const struct flash_writer *w)
+{
+	return w->bad_blocks;
+}
+
+int flash_writer_close(struct flash_writer *w)
+{
+	int ret = 0;
+
+	if (w->ubi)
+		goto out;
+
+	/* Pad the last page with 0xff, like "nandwrite -p" */
+	if (w->fill) {
+		size_t len = ((w->fill + w->info.writesize - 1) /
+			      w->info.writesize) * w->info.writesize;
+
+		memset(w->block + w->fill, 0xff, len - w->fill);
+		ret = flash_writer_block(w, w->block, len);
+	}
+
+	/* Erase the remaining good blocks of the partition */
+	while (! ret && w->blockstart < w->info.size)
+		ret = flash_writer_block(w, NULL, 0);
+
+out:
+	if (close(w->fd) && ! ret) {
+		printf("ERROR: I/O error on %s: %s\n", w->devname, strerror(errno));
+		ret = -1;
+	}
+
+	free(w->block);
+	free(w);
+
+	return ret;
+}
+
+/*
+ * Give up a write that failed or was interrupted. Neither the last
+ * block is written nor the rest of the partition erased, and an
+ * unfinished UBI volume update is left for UBI to mark corrupted.
+ */
+void flash_writer_abort(struct flash_writer *w)
+{
+	close(w->fd);
+	free(w->block);
+	free(w);
+}
+
+static int64_t read_sysfs_u64(const char *path)
+{
+	unsigned long long value;
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "r");
+	if (! f)
+		return -1;
+
+	ret = fscanf(f, "%llu", &value);
+	fclose(f);
+
+	return ret == 1 ? (int64_t) value : -1;
+}
+
+/*
+ * Size in bytes of the MTD partition or UBI volume a part is flashed
+ * to, as found in sysfs, or -1 if it cannot be known. UBI volumes are
+ * designated by their /dev/ubi/<name> link to the ubiX_Y device.
+ */
+int64_t flash_part_size(const char *part, int ubi)
+{
+	char path[PATH_MAX], ubidev[NAME_MAX + 1], *dev;
+	int64_t ebs, ebsize;
+
+	if (! ubi) {
+		snprintf(path, sizeof(path), "/sys/class/mtd/%s/size", part);
+		return read_sysfs_u64(path);
+	}
+
+	snprintf(path, sizeof(path), "/dev/ubi/%s", part);
+	dev = realpath(path, NULL);
+	if (! dev)
+		return -1;
+
+	/* The volume is ubiX_Y, its eraseblock size is an attribute of
+	   the ubiX device */
+	snprintf(ubidev, sizeof(ubidev), "%s", strrchr(dev, '/') + 1);
+	free(dev);
+
+	snprintf(path, sizeof(path), "/sys/class/ubi/%s/reserved_ebs", ubidev);
+	ebs = read_sysfs_u64(path);
+
+	if (strchr(ubidev, '_'))
+		*strchr(ubidev, '_') = '\0';
+	snprintf(path, sizeof(path), "/sys/class/ubi/%s/usable_eb_size", ubidev);
+	ebsize = read_sysfs_u64(path);
+
+	if (ebs < 0 || ebsize < 0)
+		return -1;
+
+	return ebs * ebsize;
+}
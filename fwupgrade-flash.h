@@ -0,0 +1,21 @@
+#ifndef __FWUPGRADE_FLASH_H__
+#define __FWUPGRADE_FLASH_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+int flash_block_isbad(int fd, loff_t offset);
+int flash_block_markbad(int fd, loff_t offset);
+int64_t flash_part_size(const char *part, int ubi);
+int flash_bbt_scan(const char *part);
+
+struct flash_writer;
+
+struct flash_writer *flash_writer_open_mtd(const char *part);
+struct flash_writer *flash_writer_open_ubi(const char *volume, uint64_t size);
+int flash_writer_write(struct flash_writer *w, const char *data, size_t len);
+unsigned int flash_writer_bad_blocks(const struct flash_writer *w);
+int flash_writer_close(struct flash_writer *w);
+void flash_writer_abort(struct flash_writer *w);
+
+#endif /* __FWUPGRADE_FLASH_H__ */
@@ -0,0 +1,604 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "fwupgrade-http.h"
+
+/*
+ * Pull mode: the image is downloaded from an http:// URL with several
+ * connections at once, each fetching one chunk of HTTP_CHUNK_SZ bytes
+ * at a time with a Range request. The chunks are handed to the
+ * consumer in order as soon as they are there, so that the beginning
+ * of the image is checked and flashed while the rest is downloaded.
+ * At most HTTP_WINDOW chunks per connection are kept in memory.
+ *
+ * A server that ignores Range requests is read over a single
+ * connection.
+ */
+#define HTTP_CHUNK_SZ (1024 * 1024)
+#define HTTP_WINDOW 2
+
+/* Attempts at fetching a chunk, and seconds without data before one
+   is given up */
+#define HTTP_RETRIES 3
+#define HTTP_TIMEOUT 30
+
+/* Maximum size of the status line and headers of a response */
+#define HTTP_HEAD_SZ 8192
+
+struct http_url {
+	char host[256];
+	char port[8];
+	char path[2048];
+};
+
+struct http_response {
+	int                 fd;
+	int                 status;
+	long long           length;       /* Content-Length, or -1 */
+	unsigned long long  range_start;  /* from Content-Range */
+	unsigned long long  range_end;
+	unsigned long long  total;        /* from Content-Range, or 0 */
+	size_t              start, end;   /* of the body read with the head */
+	char                buf[HTTP_HEAD_SZ];
+};
+
+struct http_chunk {
+	char   *data;
+	size_t  len;
+	int     ready;
+};
+
+struct http_pull {
+	const struct http_url *url;
+	unsigned long long     total;
+	unsigned long long     count;     /* of chunks */
+	unsigned long long     next;      /* chunk to fetch next */
+	unsigned long long     consumed;  /* chunks handed to the consumer */
+	unsigned int           window;
+	struct http_chunk     *chunks;    /* chunk i is in chunks[i % window] */
+	int                    error;
+	pthread_mutex_t        lock;
+	pthread_cond_t         cond;
+};
+
+static int http_parse_url(const char *url, struct http_url *u)
+{
+	const char *host, *path, *port, *end;
+	size_t host_len, len;
+
+	if (strncasecmp(url, "http://", 7)) {
+		printf("ERROR: only http:// URLs are supported, aborting.\n");
+		return -1;
+	}
+
+	host = url + 7;
+	path = strchr(host, '/');
+	if (! path)
+		path = host + strlen(host);
+
+	/* An IPv6 address is between brackets */
+	if (*host == '[') {
+		end = memchr(host, ']', path - host);
+		if (! end)
+			goto invalid;
+		host++;
+		host_len = end - host;
+		port = end + 1 < path && end[1] == ':' ? end + 2 : NULL;
+	} else {
+		port = memchr(host, ':', path - host);
+		host_len = (port ? port : path) - host;
+		if (port)
+			port++;
+	}
+
+	if (! host_len || host_len >= sizeof(u->host))
+		goto invalid;
+	memcpy(u->host, host, host_len);
+	u->host[host_len] = '\0';
+
+	if (port) {
+		len = path - port;
+		if (! len || len >= sizeof(u->port) ||
+		    strspn(port, "0123456789") < len)
+			goto invalid;
+		memcpy(u->port, port, len);
+		u->port[len] = '\0';
+	} else {
+		strcpy(u->port, "80");
+	}
+
+	if (strlen(path) >= sizeof(u->path))
+		goto invalid;
+	strcpy(u->path, *path ? path : "/");
+
+	return 0;
+
+invalid:
+	printf("ERROR: invalid URL %s, aborting.\n", url);
+	return -1;
+}
+
+static int http_connect(const struct http_url *u)
+{
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv = { HTTP_TIMEOUT, 0 };
+	int fd = -1, ret;
+
+	memset(& hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	ret = getaddrinfo(u->host, u->port, & hints, & res);
+	if (ret) {
+		printf("ERROR: Cannot resolve %s: %s\n", u->host,
+		       gai_strerror(ret));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, & tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, & tv, sizeof(tv));
+
+		if (! connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd < 0)
+		printf("ERROR: Cannot connect to %s port %s: %s\n", u->host,
+		       u->port, strerror(errno));
+
+	return fd;
+}
+
+/* Parse the status line and the headers in r->buf */
+static int http_parse_head(struct http_response *r)
+{
+	char *line, *next, *value, *end;
+
+	line = r->buf;
+	next = strstr(line, "\r\n");
+	*next = '\0';
+
+	if (strncmp(line, "HTTP/1.", 7) || ! strchr(line, ' '))
+		return -1;
+	r->status = atoi(strchr(line, ' ') + 1);
+
+	for (line = next + 2; *line; line = next + 2) {
+		next = strstr(line, "\r\n");
+		*next = '\0';
+
+		value = strchr(line, ':');
+		if (! value)
+			return -1;
+		*value++ = '\0';
+		while (*value == ' ' || *value == '\t')
+			value++;
+
+		if (! strcasecmp(line, "Content-Length")) {
+			r->length = strtoll(value, & end, 10);
+			if (*end || r->length < 0)
+				return -1;
+		} else if (! strcasecmp(line, "Content-Range")) {
+			if (sscanf(value, "bytes %llu-%llu/%llu", & r->range_start,
+				   & r->range_end, & r->total) != 3)
+				r->total = 0;
+		} else if (! strcasecmp(line, "Transfer-Encoding") &&
+			   strcasecmp(value, "identity")) {
+			/* Not sent in answer to an HTTP/1.0 request */
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Send a GET request for the bytes from start to end included, or for
+ * the whole resource if end is below start, and read the head of the
+ * response. Returns 0 with the connection in r->fd, or -1.
+ */
+static int http_request(const struct http_url *u, unsigned long long start,
+			unsigned long long end, struct http_response *r)
+{
+	char request[HTTP_HEAD_SZ], range[64] = "";
+	size_t len, done;
+	ssize_t n;
+	char *head_end;
+
+	memset(r, 0, offsetof(struct http_response, buf));
+	r->length = -1;
+
+	r->fd = http_connect(u);
+	if (r->fd < 0)
+		return -1;
+
+	if (end >= start)
+		snprintf(range, sizeof(range), "Range: bytes=%llu-%llu\r\n",
+			 start, end);
+
+	/* HTTP/1.0, so that the body is neither chunked nor followed by
+	   another response */
+	len = snprintf(request, sizeof(request),
+		       "GET %s HTTP/1.0\r\n"
+		       "Host: %s%s%s:%s\r\n"
+		       "%s"
+		       "User-Agent: fwupgrade\r\n\r\n",
+		       u->path, strchr(u->host, ':') ? "[" : "", u->host,
+		       strchr(u->host, ':') ? "]" : "", u->port, range);
+
+	for (done = 0; done < len; done += n) {
+		n = send(r->fd, request + done, len - done, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n < 0)
+			goto error;
+	}
+
+	for (;;) {
+		if (r->end == sizeof(r->buf) - 1)
+			goto invalid;
+
+		n = recv(r->fd, r->buf + r->end, sizeof(r->buf) - 1 - r->end, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			goto error;
+
+		r->end += n;
+		r->buf[r->end] = '\0';
+
+		head_end = strstr(r->buf, "\r\n\r\n");
+		if (head_end)
+			break;
+	}
+
+	/* The empty line ends the headers for http_parse_head */
+	head_end[2] = '\0';
+	r->start = head_end + 4 - r->buf;
+
+	if (http_parse_head(r))
+		goto invalid;
+
+	return 0;
+
+invalid:
+	printf("ERROR: Invalid response from %s, aborting.\n", u->host);
+	close(r->fd);
+	return -1;
+
+error:
+	printf("ERROR: No response from %s: %s\n", u->host,
+	       n < 0 ? strerror(errno) : "connection closed");
+	close(r->fd);
+	return -1;
+}
+
+/* Read the body of a response, returns 0 at its end or -1 on error */
+static ssize_t http_read(struct http_response *r, char *data, size_t len)
+{
+	ssize_t n;
+
+	if (r->start < r->end) {
+		n = r->end - r->start;
+		if (n > len)
+			n = len;
+		memcpy(data, r->buf + r->start, n);
+		r->start += n;
+		return n;
+	}
+
+	do {
+		n = recv(r->fd, data, len, 0);
+	} while (n < 0 && errno == EINTR);
+
+	return n;
+}
+
+/* Download chunk index into its slot, with a few attempts */
+static int http_fetch_chunk(struct http_pull *pull, unsigned long long index,
+			    struct http_chunk *chunk)
+{
+	unsigned long long start = index * HTTP_CHUNK_SZ;
+	struct http_response *r;
+	unsigned int tries;
+	size_t len;
+	ssize_t n;
+
+	chunk->len = pull->total - start < HTTP_CHUNK_SZ ?
+		pull->total - start : HTTP_CHUNK_SZ;
+
+	r = malloc(sizeof(*r));
+	if (! r) {
+		printf("ERROR: memory allocation problem, aborting.\n");
+		return -1;
+	}
+
+	for (tries = 0; tries < HTTP_RETRIES; tries++) {
+		if (http_request(pull->url, start, start + chunk->len - 1, r))
+			continue;
+
+		if (r->status != 206 || r->range_start != start ||
+		    r->range_end != start + chunk->len - 1 ||
+		    r->total != pull->total) {
+			printf("ERROR: Unexpected answer to the range request at %llu (status %d), aborting.\n",
+			       start, r->status);
+			close(r->fd);
+			break;
+		}
+
+		for (len = 0; len < chunk->len; len += n) {
+			n = http_read(r, chunk->data + len, chunk->len - len);
+			if (n <= 0)
+				break;
+		}
+
+		close(r->fd);
+
+		if (len == chunk->len) {
+			free(r);
+			return 0;
+		}
+
+		printf("Download of the range at %llu interrupted, retrying\n",
+		       start);
+	}
+
+	free(r);
+	return -1;
+}
+
+static void *http_worker(void *arg)
+{
+	struct http_pull *pull = arg;
+	struct http_chunk *chunk;
+	unsigned long long index;
+	int ret;
+
+	pthread_mutex_lock(& pull->lock);
+
+	for (;;) {
+		/* A chunk slot is free once the consumer is done with
+		   the chunk a window before */
+		while (! pull->error && pull->next < pull->count &&
+		       pull->next >= pull->consumed + pull->window)
+			pthread_cond_wait(& pull->cond, & pull->lock);
+
+		if (pull->error || pull->next >= pull->count)
+			break;
+
+		index = pull->next++;
+		chunk = & pull->chunks[index % pull->window];
+		pthread_mutex_unlock(& pull->lock);
+
+		ret = http_fetch_chunk(pull, index, chunk);
+
+		pthread_mutex_lock(& pull->lock);
+		if (ret)
+			pull->error = 1;
+		else
+			chunk->ready = 1;
+		pthread_cond_broadcast(& pull->cond);
+	}
+
+	pthread_mutex_unlock(& pull->lock);
+
+	return NULL;
+}
+
+/* Hand the chunks to feed in order, as they are downloaded */
+static int http_consume(struct http_pull *pull, fwupgrade_cgi_feed feed,
+			void *ctx)
+{
+	struct http_chunk *chunk;
+	unsigned long long index;
+	int ret = 0;
+
+	for (index = 0; index < pull->count && ! ret; index++) {
+		chunk = & pull->chunks[index % pull->window];
+
+		pthread_mutex_lock(& pull->lock);
+		while (! chunk->ready && ! pull->error)
+			pthread_cond_wait(& pull->cond, & pull->lock);
+		ret = pull->error ? -1 : 0;
+		pthread_mutex_unlock(& pull->lock);
+
+		if (ret)
+			break;
+
+		ret = feed(ctx, chunk->data, chunk->len);
+
+		pthread_mutex_lock(& pull->lock);
+		chunk->ready = 0;
+		pull->consumed++;
+		if (ret)
+			pull->error = 1;
+		pthread_cond_broadcast(& pull->cond);
+		pthread_mutex_unlock(& pull->lock);
+	}
+
+	return ret;
+}
+
+/* Read a whole response over its connection, for servers without ranges */
+static int http_stream(struct http_response *r, fwupgrade_cgi_feed feed,
+		       void *ctx)
+{
+	unsigned long long received = 0;
+	char *buf;
+	ssize_t n;
+	int ret = -1;
+
+	buf = malloc(HTTP_CHUNK_SZ);
+	if (! buf) {
+		printf("ERROR: memory allocation problem, aborting.\n");
+		return -1;
+	}
+
+	while ((n = http_read(r, buf, HTTP_CHUNK_SZ)) > 0) {
+		received += n;
+		if (feed(ctx, buf, n))
+			goto out;
+	}
+
+	if (n < 0 || (r->length >= 0 && received != r->length))
+		printf("ERROR: Download interrupted after %llu bytes, aborting.\n",
+		       received);
+	else
+		ret = 0;
+
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Download the image at url over up to connections connections, and
+ * hand it to feed piece by piece, in order. Returns 0 once the whole
+ * image has been fed.
+ */
+int fwupgrade_http_pull(const char *url, unsigned int connections,
+			fwupgrade_cgi_feed feed, void *ctx)
+{
+	struct http_response *first = NULL;
+	pthread_t threads[FWUPGRADE_HTTP_MAX_CONNECTIONS];
+	struct http_pull pull;
+	struct http_url u;
+	unsigned int i, started = 0;
+	size_t len;
+	ssize_t n;
+	int ret = -1;
+
+	if (http_parse_url(url, & u))
+		return -1;
+
+	memset(& pull, 0, sizeof(pull));
+	pull.url = & u;
+	pthread_mutex_init(& pull.lock, NULL);
+	pthread_cond_init(& pull.cond, NULL);
+
+	if (connections < 1)
+		connections = 1;
+	if (connections > FWUPGRADE_HTTP_MAX_CONNECTIONS)
+		connections = FWUPGRADE_HTTP_MAX_CONNECTIONS;
+
+	first = malloc(sizeof(*first));
+	if (! first) {
+		printf("ERROR: memory allocation problem, aborting.\n");
+		goto out;
+	}
+
+	/* The first chunk tells the size of the image, and whether the
+	   server takes range requests */
+	if (http_request(& u, 0, HTTP_CHUNK_SZ - 1, first))
+		goto out;
+
+	if (first->status == 200) {
+		printf("Downloading %s over a single connection\n", url);
+		ret = http_stream(first, feed, ctx);
+		close(first->fd);
+		goto out;
+	}
+
+	if (first->status != 206 || first->range_start != 0 || ! first->total) {
+		printf("ERROR: HTTP status %d for %s, aborting.\n",
+		       first->status, url);
+		close(first->fd);
+		goto out;
+	}
+
+	pull.total = first->total;
+	pull.count = (pull.total + HTTP_CHUNK_SZ - 1) / HTTP_CHUNK_SZ;
+	pull.window = connections * HTTP_WINDOW;
+	if (pull.window > pull.count)
+		pull.window = pull.count;
+
+	pull.chunks = calloc(pull.window, sizeof(*pull.chunks));
+	if (! pull.chunks) {
+		close(first->fd);
+		printf("ERROR: memory allocation problem, aborting.\n");
+		goto out;
+	}
+
+	for (i = 0; i < pull.window; i++) {
+		pull.chunks[i].data = malloc(HTTP_CHUNK_SZ);
+		if (! pull.chunks[i].data) {
+			close(first->fd);
+			printf("ERROR: memory allocation problem, aborting.\n");
+			goto out;
+		}
+	}
+
+	printf("Downloading %s (%llu bytes, %u connections)\n", url,
+	       pull.total, connections);
+
+	pull.chunks[0].len = pull.total < HTTP_CHUNK_SZ ?
+		pull.total : HTTP_CHUNK_SZ;
+	for (len = 0; len < pull.chunks[0].len; len += n) {
+		n = http_read(first, pull.chunks[0].data + len,
+			      pull.chunks[0].len - len);
+		if (n <= 0)
+			break;
+	}
+	close(first->fd);
+
+	if (len != pull.chunks[0].len) {
+		printf("ERROR: Download interrupted, aborting.\n");
+		goto out;
+	}
+
+	pull.chunks[0].ready = 1;
+	pull.next = 1;
+
+	for (i = 0; i < connections && i + 1 < pull.count; i++) {
+		if (pthread_create(& threads[i], NULL, http_worker, & pull))
+			break;
+		started++;
+	}
+
+	if (! started && pull.count > 1)
+		printf("ERROR: Cannot start the download threads, aborting.\n");
+	else
+		ret = http_consume(& pull, feed, ctx);
+
+	pthread_mutex_lock(& pull.lock);
+	pull.error = 1;
+	pthread_cond_broadcast(& pull.cond);
+	pthread_mutex_unlock(& pull.lock);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+out:
+	if (pull.chunks) {
+		for (i = 0; i < pull.window; i++)
+			free(pull.chunks[i].data);
+		free(pull.chunks);
+	}
+	free(first);
+	pthread_cond_destroy(& pull.cond);
+	pthread_mutex_destroy(& pull.lock);
+
+	return ret;
+}
@@ -0,0 +1,13 @@
+#ifndef __FWUPGRADE_HTTP_H__
+#define __FWUPGRADE_HTTP_H__
+
+#include "fwupgrade-cgi.h"
+
+/* Default number of connections of a pull */
+#define FWUPGRADE_HTTP_CONNECTIONS 4
+#define FWUPGRADE_HTTP_MAX_CONNECTIONS 16
+
+int fwupgrade_http_pull(const char *url, unsigned int connections,
+			fwupgrade_cgi_feed feed, void *ctx);
+
+#endif /* __FWUPGRADE_HTTP_H__ */
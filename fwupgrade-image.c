@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "fwupgrade-image.h"
+
+/*
+ * Parse the header of a firmware image, of either version, into
+ * image. Only the header has to be available in data: the part data
+ * is not looked at, and image->size tells where the last part ends
+ * so that callers can check it against what they have. Returns 0 or
+ * one of the FWIMAGE_E* errors.
+ */
+int fwimage_parse(const void *data, uint64_t length, struct fwimage *image)
+{
+	const struct fwheader *v1 = data;
+	const struct fwheader_v2 *v2 = data;
+	const struct fwpart_v2 *v2parts;
+	unsigned int i, count;
+
+	memset(image, 0, sizeof(*image));
+
+	if (length < sizeof(uint32_t))
+		return FWIMAGE_ETRUNC;
+
+	switch (le32toh(v1->magic)) {
+	case FWUPGRADE_MAGIC:
+		if (length < sizeof(struct fwheader))
+			return FWIMAGE_ETRUNC;
+
+		image->version     = 1;
+		image->hwid        = le32toh(v1->hwid);
+		image->flags       = le32toh(v1->flags);
+		image->align       = le32toh(v1->align);
+		image->header_size = sizeof(struct fwheader);
+
+		image->parts = calloc(FWPART_COUNT, sizeof(struct fwimage_part));
+		if (! image->parts)
+			return FWIMAGE_ENOMEM;
+
+		/* Unused part slots have a zero length */
+		for (i = 0, count = 0; i < FWPART_COUNT; i++) {
+			struct fwimage_part *part = & image->parts[count];
+
+			if (! le32toh(v1->parts[i].length))
+				continue;
+
+			memcpy(part->name, v1->parts[i].name, FWPART_NAME_SZ);
+			memcpy(part->crc, v1->parts[i].crc, FWPART_CRC_SZ);
+			part->length = le32toh(v1->parts[i].length);
+			part->offset = le32toh(v1->parts[i].offset);
+			count++;
+		}
+		break;
+
+	case FWUPGRADE_MAGIC_V2:
+		if (length < sizeof(struct fwheader_v2))
+			return FWIMAGE_ETRUNC;
+
+		count = le32toh(v2->part_count);
+
+		image->version     = 2;
+		image->hwid        = le32toh(v2->hwid);
+		image->flags       = le32toh(v2->flags);
+		image->align       = le32toh(v2->align);
+		image->header_size = fwimage_header_size(2, count);
+
+		if (length < image->header_size)
+			return FWIMAGE_ETRUNC;
+
+		image->parts = calloc(count ? count : 1, sizeof(struct fwimage_part));
+		if (! image->parts)
+			return FWIMAGE_ENOMEM;
+
+		v2parts = (const struct fwpart_v2 *) (v2 + 1);
+		for (i = 0; i < count; i++) {
+			struct fwimage_part *part = & image->parts[i];
+
+			memcpy(part->name, v2parts[i].name, FWPART_NAME_SZ);
+			memcpy(part->crc, v2parts[i].crc, FWPART_CRC_SZ);
+			part->length = le64toh(v2parts[i].length);
+			part->offset = le64toh(v2parts[i].offset);
+		}
+		break;
+
+	default:
+		return FWIMAGE_EMAGIC;
+	}
+
+	image->part_count = count;
+
+	for (i = 0; i < count; i++) {
+		struct fwimage_part *part = & image->parts[i];
+
+		part->name[FWPART_NAME_SZ - 1] = '\0';
+
+		if (part->offset < image->header_size ||
+		    part->offset + part->length < part->offset) {
+			fwimage_release(image);
+			return FWIMAGE_ETRUNC;
+		}
+
+		if (part->offset + part->length > image->size)
+			image->size = part->offset + part->length;
+	}
+
+	if (image->size < image->header_size)
+		image->size = image->header_size;
+
+	return 0;
+}
+
+void fwimage_release(struct fwimage *image)
+{
+	free(image->parts);
+	image->parts = NULL;
+	image->part_count = 0;
+}
+
+const char *fwimage_strerror(int err)
+{
+	switch (err) {
+	case FWIMAGE_EMAGIC:
+		return "invalid firmware magic";
+	case FWIMAGE_ETRUNC:
+		return "truncated firmware image";
+	case FWIMAGE_ENOMEM:
+		return "memory allocation problem";
+	default:
+		return "unknown error";
+	}
+}
+
+/* Size of the header, including the part table, of an image */
+uint64_t fwimage_header_size(unsigned int version, unsigned int part_count)
+{
+	if (version == 1)
+		return sizeof(struct fwheader);
+
+	return sizeof(struct fwheader_v2) +
+		(uint64_t) part_count * sizeof(struct fwpart_v2);
+}
+
+/*
+ * Fill buf, which must hold fwimage_header_size() bytes, with the
+ * on-disk header of image. A version 1 image can have at most
+ * FWPART_COUNT parts, all smaller than 4 GB.
+ */
+void fwimage_build_header(const struct fwimage *image, void *buf)
+{
+	unsigned int i;
+
+	memset(buf, 0, fwimage_header_size(image->version, image->part_count));
+
+	if (image->version == 1) {
+		struct fwheader *v1 = buf;
+
+		v1->magic = htole32(FWUPGRADE_MAGIC);
+		v1->hwid  = htole32(image->hwid);
+		v1->flags = htole32(image->flags);
+		v1->align = htole32(image->align);
+
+		for (i = 0; i < image->part_count; i++) {
+			memcpy(v1->parts[i].name, image->parts[i].name, FWPART_NAME_SZ);
+			memcpy(v1->parts[i].crc, image->parts[i].crc, FWPART_CRC_SZ);
+			v1->parts[i].length = htole32(image->parts[i].length);
+			v1->parts[i].offset = htole32(image->parts[i].offset);
+		}
+	} else {
+		struct fwheader_v2 *v2 = buf;
+		struct fwpart_v2 *v2parts = (struct fwpart_v2 *) (v2 + 1);
+
+		v2->magic      = htole32(FWUPGRADE_MAGIC_V2);
+		v2->hwid       = htole32(image->hwid);
+		v2->flags      = htole32(image->flags);
+		v2->part_count = htole32(image->part_count);
+		v2->align      = htole32(image->align);
+
+		for (i = 0; i < image->part_count; i++) {
+			memcpy(v2parts[i].name, image->parts[i].name, FWPART_NAME_SZ);
+			memcpy(v2parts[i].crc, image->parts[i].crc, FWPART_CRC_SZ);
+			v2parts[i].length = htole64(image->parts[i].length);
+			v2parts[i].offset = htole64(image->parts[i].offset);
+		}
+	}
+}
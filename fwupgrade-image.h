@@ -0,0 +1,39 @@
+#ifndef __FWUPGRADE_IMAGE_H__
+#define __FWUPGRADE_IMAGE_H__
+
+#include <stdint.h>
+
+#include "fwupgrade.h"
+
+/* Version independent description of one part of a firmware image */
+struct fwimage_part {
+	char     name[FWPART_NAME_SZ];
+	char     crc[FWPART_CRC_SZ];
+	uint64_t length;
+	uint64_t offset;
+};
+
+/* Version independent description of a firmware image header */
+struct fwimage {
+	unsigned int         version;
+	unsigned int         hwid;
+	unsigned int         flags;
+	unsigned int         part_count;
+	unsigned int         align;       /* of the part offsets, or 0 */
+	uint64_t             header_size;
+	uint64_t             size;        /* end of the last part */
+	struct fwimage_part *parts;
+};
+
+#define FWIMAGE_EMAGIC  -1 /* Unknown magic */
+#define FWIMAGE_ETRUNC  -2 /* Header or part data past the end of the image */
+#define FWIMAGE_ENOMEM  -3 /* Memory allocation failure */
+
+int fwimage_parse(const void *data, uint64_t length, struct fwimage *image);
+void fwimage_release(struct fwimage *image);
+const char *fwimage_strerror(int err);
+
+uint64_t fwimage_header_size(unsigned int version, unsigned int part_count);
+void fwimage_build_header(const struct fwimage *image, void *buf);
+
+#endif /* __FWUPGRADE_IMAGE_H__ */
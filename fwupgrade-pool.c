@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "fwupgrade-pool.h"
+
+/*
+ * Minimal thread pool: fwpool_run() calls func(ctx, index) for every
+ * index in [0, count) on up to "threads" threads, each thread picking
+ * the next index to process until none are left or one call failed.
+ */
+struct fwpool {
+	pthread_mutex_t lock;
+	unsigned int    next;
+	unsigned int    count;
+	int             ret;
+	fwpool_func     func;
+	void           *ctx;
+};
+
+unsigned int fwpool_default_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+static void *fwpool_worker(void *arg)
+{
+	struct fwpool *pool = arg;
+	unsigned int index;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->ret || pool->next >= pool->count) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		index = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = pool->func(pool->ctx, index);
+		if (ret) {
+			pthread_mutex_lock(&pool->lock);
+			if (! pool->ret)
+				pool->ret = ret;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+}
+
+/*
+ * Returns 0 when every call succeeded, otherwise the return value of
+ * the first failed call. Once a call failed, no new index is started.
+ */
+int fwpool_run(unsigned int threads, unsigned int count,
+	       fwpool_func func, void *ctx)
+{
+	struct fwpool pool;
+	pthread_t *tids;
+	unsigned int i, started;
+
+	pool.next  = 0;
+	pool.count = count;
+	pool.ret   = 0;
+	pool.func  = func;
+	pool.ctx   = ctx;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	if (threads > count)
+		threads = count;
+
+	tids = threads > 1 ? calloc(threads, sizeof(pthread_t)) : NULL;
+
+	/* The calling thread always takes part, so that a failure to
+	   start threads only makes things slower */
+	started = 0;
+	for (i = 1; tids && i < threads; i++)
+		if (! pthread_create(&tids[started], NULL, fwpool_worker, &pool))
+			started++;
+
+	fwpool_worker(&pool);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	free(tids);
+	pthread_mutex_destroy(&pool.lock);
+
+	return pool.ret;
+}
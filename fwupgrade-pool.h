@@ -0,0 +1,10 @@
+#ifndef __FWUPGRADE_POOL_H__
+#define __FWUPGRADE_POOL_H__
+
+typedef int (*fwpool_func)(void *ctx, unsigned int index);
+
+unsigned int fwpool_default_threads(void);
+int fwpool_run(unsigned int threads, unsigned int count,
+	       fwpool_func func, void *ctx);
+
+#endif /* __FWUPGRADE_POOL_H__ */
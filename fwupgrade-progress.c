@@ -0,0 +1,488 @@
+#define _GNU_SOURCE /* for accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "fwupgrade.h"
+#include "fwupgrade-cgi.h"
+#include "fwupgrade-progress.h"
+
+/*
+ * Progress of the upgrade in progress. The process doing the upgrade
+ * keeps a few counters in a small file mapped in memory, which other
+ * processes map to report them: a GET request with ?progress in the
+ * query string, answered with JSON lines or server-sent events, and
+ * in command line mode the clients of a Unix socket.
+ *
+ * The data path only updates the counters, under a sequence counter
+ * that readers check to get a consistent copy without taking a lock.
+ * The lines are formatted by the readers, at most every
+ * PROGRESS_INTERVAL milliseconds.
+ */
+#ifndef FWUPGRADE_PROGRESS
+#define FWUPGRADE_PROGRESS "/var/run/fwupgrade-progress"
+#endif
+
+/* Between two lines, in milliseconds */
+#define PROGRESS_INTERVAL 500
+
+/* Number of intervals after which a line is sent even if nothing
+   changed */
+#define PROGRESS_KEEPALIVE 20
+
+#define PROGRESS_MAX_CLIENTS 8
+#define PROGRESS_LINE_SZ 512
+
+enum {
+	PROGRESS_RUNNING,
+	PROGRESS_DONE,
+	PROGRESS_FAILED,
+};
+
+struct progress {
+	uint32_t seq;            /* odd while being updated */
+	int32_t  pid;            /* of the upgrade */
+	uint32_t state;          /* PROGRESS_* */
+	uint32_t bad_blocks;     /* of the whole upgrade */
+	char     stage[16];
+	char     part[FWPART_NAME_SZ];
+	char     target[64];     /* partition being flashed */
+	uint64_t start;          /* of the stage, in monotonic ns */
+	uint64_t end;            /* of the upgrade, or 0 */
+	uint64_t done;           /* bytes of the stage */
+	uint64_t total;          /* or 0 when unknown */
+};
+
+/* Used until the file is mapped, or when it cannot be */
+static struct progress progress_local;
+static struct progress *progress = & progress_local;
+
+/* Bad blocks counted before the current stage */
+static unsigned int progress_bad_base;
+
+static int progress_listen_fd = -1;
+static pthread_t progress_thread;
+static int progress_stopping;
+static char progress_socket_path[108];
+
+static uint64_t progress_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, & ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* There is a single writer, so the sequence needs no atomic update */
+static void progress_begin_update(void)
+{
+	__atomic_store_n(& progress->seq, progress->seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void progress_end_update(void)
+{
+	__atomic_store_n(& progress->seq, progress->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Start reporting the progress of an upgrade */
+void fwupgrade_progress_open(void)
+{
+	struct progress *p;
+	int fd;
+
+	fd = open(FWUPGRADE_PROGRESS, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW,
+		  0644);
+	if (fd >= 0) {
+		if (! ftruncate(fd, sizeof(*p))) {
+			p = mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED)
+				progress = p;
+		}
+		close(fd);
+	}
+
+	progress_begin_update();
+	progress->pid = getpid();
+	progress->state = PROGRESS_RUNNING;
+	progress->bad_blocks = 0;
+	strcpy(progress->stage, "receive");
+	progress->part[0] = '\0';
+	progress->target[0] = '\0';
+	progress->start = progress_now();
+	progress->end = 0;
+	progress->done = 0;
+	progress->total = 0;
+	progress_end_update();
+
+	progress_bad_base = 0;
+}
+
+/*
+ * Start a stage of the upgrade, on part of the image and the target
+ * partition when they apply, with total bytes to go through or 0 if
+ * unknown
+ */
+void fwupgrade_progress_stage(const char *stage, const char *part,
+			      const char *target, uint64_t total)
+{
+	progress_begin_update();
+	snprintf(progress->stage, sizeof(progress->stage), "%s", stage);
+	snprintf(progress->part, sizeof(progress->part), "%s",
+		 part ? part : "");
+	snprintf(progress->target, sizeof(progress->target), "%s",
+		 target ? target : "");
+	progress->start = progress_now();
+	progress->done = 0;
+	progress->total = total;
+	progress_end_update();
+
+	progress_bad_base = progress->bad_blocks;
+}
+
+void fwupgrade_progress_add(uint64_t bytes)
+{
+	progress_begin_update();
+	progress->done += bytes;
+	progress_end_update();
+}
+
+/* Bad blocks met by the flash writer of the current stage */
+void fwupgrade_progress_bad_blocks(unsigned int count)
+{
+	if (progress->bad_blocks == progress_bad_base + count)
+		return;
+
+	progress_begin_update();
+	progress->bad_blocks = progress_bad_base + count;
+	progress_end_update();
+}
+
+void fwupgrade_progress_finish(int ret)
+{
+	progress_begin_update();
+	progress->state = ret ? PROGRESS_FAILED : PROGRESS_DONE;
+	progress->end = progress_now();
+	strcpy(progress->stage, ret ? "failed" : "done");
+	progress_end_update();
+}
+
+/* Get a consistent copy of the counters, returns 0 on success */
+static int progress_snapshot(const struct progress *p, struct progress *snap)
+{
+	uint32_t seq;
+	int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		seq = __atomic_load_n(& p->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		memcpy(snap, p, sizeof(*snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(& p->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+
+	return -1;
+}
+
+/* Copy a name into a JSON string, dropping what would need escaping */
+static void progress_json_string(char *out, size_t size, const char *in)
+{
+	size_t len = 0;
+
+	for (; *in && len < size - 1; in++) {
+		if (*in == '"' || *in == '\\' || (unsigned char) *in < 0x20)
+			continue;
+		out[len++] = *in;
+	}
+	out[len] = '\0';
+}
+
+/* Format the JSON line describing snap, without its line ending */
+static void progress_format(const struct progress *snap, char *line,
+			    size_t size)
+{
+	char part[sizeof(snap->part)], target[sizeof(snap->target)];
+	char total[32], eta[32];
+	uint64_t elapsed = (snap->end ? snap->end : progress_now()) - snap->start;
+	double rate = 0;
+	const char *stage = snap->stage;
+
+	/* The upgrade went away without saying how it ended */
+	if (snap->state == PROGRESS_RUNNING && kill(snap->pid, 0) &&
+	    errno == ESRCH)
+		stage = "interrupted";
+
+	if (elapsed > 0)
+		rate = snap->done * 1e9 / elapsed;
+
+	strcpy(total, "null");
+	strcpy(eta, "null");
+	if (snap->total) {
+		snprintf(total, sizeof(total), "%llu",
+			 (unsigned long long) snap->total);
+		if (snap->state == PROGRESS_RUNNING &&
+		    strcmp(stage, "interrupted") && rate > 0 &&
+		    snap->done <= snap->total)
+			snprintf(eta, sizeof(eta), "%.0f",
+				 (snap->total - snap->done) / rate);
+	}
+
+	progress_json_string(part, sizeof(part), snap->part);
+	progress_json_string(target, sizeof(target), snap->target);
+
+	snprintf(line, size,
+		 "{\"stage\":\"%s\",\"part\":\"%s\",\"target\":\"%s\","
+		 "\"done\":%llu,\"total\":%s,\"mbps\":%.2f,\"eta\":%s,"
+		 "\"bad_blocks\":%u}",
+		 stage, part, target, (unsigned long long) snap->done, total,
+		 rate / 1e6, eta, snap->bad_blocks);
+}
+
+static int progress_finished(const struct progress *snap)
+{
+	return snap->state != PROGRESS_RUNNING ||
+		(kill(snap->pid, 0) && errno == ESRCH);
+}
+
+static void *progress_listener(void *arg)
+{
+	int clients[PROGRESS_MAX_CLIENTS];
+	unsigned int count = 0, i, idle = 0;
+	char line[PROGRESS_LINE_SZ + 1];
+	uint64_t next = progress_now();
+	uint32_t last_seq = 1;
+	struct progress snap;
+	struct pollfd pfd;
+	int fd, timeout, stop, send_all;
+	size_t len;
+
+	for (;;) {
+		stop = __atomic_load_n(& progress_stopping, __ATOMIC_ACQUIRE);
+
+		timeout = 0;
+		if (! stop && next > progress_now())
+			timeout = (next - progress_now()) / 1000000 + 1;
+
+		pfd.fd = progress_listen_fd;
+		pfd.events = POLLIN;
+		fd = -1;
+		if (poll(& pfd, 1, timeout) > 0 && (pfd.revents & POLLIN))
+			fd = accept4(progress_listen_fd, NULL, NULL,
+				     SOCK_CLOEXEC);
+
+		if (fd >= 0 && count == PROGRESS_MAX_CLIENTS) {
+			close(fd);
+			fd = -1;
+		}
+		if (fd >= 0)
+			clients[count++] = fd;
+
+		/* A new client gets a line right away, the others on
+		   the next interval */
+		send_all = progress_now() >= next || stop;
+		if (fd < 0 && ! send_all)
+			continue;
+
+		if (progress_snapshot(progress, & snap))
+			continue;
+
+		if (send_all) {
+			next = progress_now() + PROGRESS_INTERVAL * 1000000ULL;
+			if (snap.seq == last_seq && ++idle < PROGRESS_KEEPALIVE)
+				send_all = 0;
+			else
+				idle = 0;
+			last_seq = snap.seq;
+		}
+
+		progress_format(& snap, line, PROGRESS_LINE_SZ);
+		len = strlen(line);
+		line[len++] = '\n';
+
+		/* A client too slow to take a line is dropped */
+		for (i = 0; i < count; ) {
+			if ((send_all || clients[i] == fd) &&
+			    send(clients[i], line, len,
+				 MSG_NOSIGNAL | MSG_DONTWAIT) != len) {
+				close(clients[i]);
+				clients[i] = clients[--count];
+				continue;
+			}
+			i++;
+		}
+
+		if (stop)
+			break;
+	}
+
+	for (i = 0; i < count; i++)
+		close(clients[i]);
+
+	return NULL;
+}
+
+/*
+ * Report the progress to the clients of a Unix socket, from a thread,
+ * until fwupgrade_progress_close. Returns 0 on success.
+ */
+int fwupgrade_progress_listen(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s too long\n", socket_path);
+		return -1;
+	}
+
+	memset(& addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Cannot create socket");
+		return -1;
+	}
+
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr *) & addr, sizeof(addr)) ||
+	    listen(fd, PROGRESS_MAX_CLIENTS)) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", socket_path,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	progress_listen_fd = fd;
+	strcpy(progress_socket_path, socket_path);
+
+	if (pthread_create(& progress_thread, NULL, progress_listener, NULL)) {
+		fprintf(stderr, "Cannot start the progress thread\n");
+		close(fd);
+		unlink(socket_path);
+		progress_listen_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Send the last line to the clients of the socket, and close it */
+void fwupgrade_progress_close(void)
+{
+	if (progress_listen_fd < 0)
+		return;
+
+	__atomic_store_n(& progress_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(progress_thread, NULL);
+
+	close(progress_listen_fd);
+	unlink(progress_socket_path);
+	progress_listen_fd = -1;
+}
+
+/* Whether the request asks for the progress of the upgrade */
+int fwupgrade_progress_request(void)
+{
+	char format[8];
+
+	return ! fwupgrade_cgi_query("progress", format, sizeof(format));
+}
+
+static int progress_print(int sse, const char *line)
+{
+	if (sse)
+		printf("event: progress\ndata: %s\n\n", line);
+	else
+		printf("%s\n", line);
+
+	return fflush(stdout) || ferror(stdout) ? -1 : 0;
+}
+
+/*
+ * Answer a progress request: a line every PROGRESS_INTERVAL while the
+ * upgrade goes on, and a last one once it has ended. The lines are
+ * sent as server-sent events with ?progress=sse or when the client
+ * accepts text/event-stream, as JSON lines otherwise.
+ */
+int fwupgrade_progress_serve(void)
+{
+	char format[8], line[PROGRESS_LINE_SZ];
+	const char *accept = getenv("HTTP_ACCEPT");
+	const struct progress *p = NULL;
+	struct progress snap;
+	uint32_t last_seq = 1;
+	unsigned int idle = 0;
+	struct stat st;
+	int sse, fd;
+
+	fwupgrade_cgi_query("progress", format, sizeof(format));
+	sse = ! strcmp(format, "sse") ||
+		(accept && strstr(accept, "text/event-stream"));
+
+	fwupgrade_cgi_status_type(200, sse ? "text/event-stream" :
+				  "application/x-ndjson");
+
+	fd = open(FWUPGRADE_PROGRESS, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd >= 0) {
+		if (! fstat(fd, & st) && st.st_size >= sizeof(*p)) {
+			p = mmap(NULL, sizeof(*p), PROT_READ, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED)
+				p = NULL;
+		}
+		close(fd);
+	}
+
+	/* No upgrade has been run since the system started */
+	if (! p) {
+		progress_print(sse, "{\"stage\":\"idle\"}");
+		return 0;
+	}
+
+	for (;;) {
+		if (! progress_snapshot(p, & snap)) {
+			if (snap.seq != last_seq || ++idle >= PROGRESS_KEEPALIVE ||
+			    progress_finished(& snap)) {
+				progress_format(& snap, line, sizeof(line));
+				if (progress_print(sse, line))
+					break;
+				idle = 0;
+			}
+			last_seq = snap.seq;
+
+			if (progress_finished(& snap))
+				break;
+		} else if (kill(p->pid, 0) && errno == ESRCH) {
+			/* Gone in the middle of an update */
+			break;
+		}
+
+		usleep(PROGRESS_INTERVAL * 1000);
+	}
+
+	munmap((void *) p, sizeof(*p));
+
+	return 0;
+}
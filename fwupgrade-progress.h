@@ -0,0 +1,20 @@
+#ifndef __FWUPGRADE_PROGRESS_H__
+#define __FWUPGRADE_PROGRESS_H__
+
+#include <stdint.h>
+
+/* Updates, from the process doing the upgrade */
+void fwupgrade_progress_open(void);
+void fwupgrade_progress_stage(const char *stage, const char *part,
+			      const char *target, uint64_t total);
+void fwupgrade_progress_add(uint64_t bytes);
+void fwupgrade_progress_bad_blocks(unsigned int count);
+void fwupgrade_progress_finish(int ret);
+
+/* Feeds, to other processes */
+int fwupgrade_progress_listen(const char *socket_path);
+void fwupgrade_progress_close(void);
+int fwupgrade_progress_request(void);
+int fwupgrade_progress_serve(void);
+
+#endif /* __FWUPGRADE_PROGRESS_H__ */
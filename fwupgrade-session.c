@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "fwupgrade-cgi.h"
+#include "fwupgrade-session.h"
+
+/*
+ * Resumable uploads. A client that passes ?session=ID in the query
+ * string sends the image in pieces, each with a Content-Range header,
+ * and the received data is kept in a staging file until the whole
+ * image is there. A GET on the same URL tells how much has been
+ * received, so that an interrupted upload resumes from there, and a
+ * DELETE drops the session.
+ *
+ * The staging directory is in the root only runtime directory, on
+ * tmpfs, by default. It can be moved to a spare UBI volume by building
+ * with -DSESSION_DIR=\"/path\". Whoever could write in it could have
+ * fwupgrade flash their own image, so it must be a directory of ours
+ * that nobody else can enter, and no file in it is opened through a
+ * symbolic link.
+ */
+#ifndef SESSION_DIR
+#define SESSION_DIR "/var/run/fwupgrade-sessions"
+#endif
+
+#define SESSION_ID_SZ 64
+
+struct session_write {
+	int                fd;
+	unsigned long long written;
+	unsigned long long max;
+};
+
+static int session_error(int status, const char *msg)
+{
+	fwupgrade_cgi_status(status);
+	printf("ERROR: %s, aborting.\n", msg);
+	return -1;
+}
+
+/* The session id, taken from the query string, or NULL */
+const char *fwupgrade_session_id(void)
+{
+	/* One more byte, to tell a longer id from a truncated one */
+	static char id[SESSION_ID_SZ + 2];
+	size_t len;
+
+	if (fwupgrade_cgi_query("session", id, sizeof(id)))
+		return NULL;
+
+	len = strlen(id);
+	if (len == 0 || len > SESSION_ID_SZ)
+		return NULL;
+
+	/* The id ends up in a file name */
+	if (strspn(id, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		       "abcdefghijklmnopqrstuvwxyz0123456789-_") < len)
+		return NULL;
+
+	return id;
+}
+
+/* Create the staging directory, or check the one already there */
+static int session_dir(void)
+{
+	struct stat st;
+
+	if (mkdir(SESSION_DIR, 0700) && errno != EEXIST)
+		return -1;
+
+	if (lstat(SESSION_DIR, & st) || ! S_ISDIR(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & 0777) != 0700)
+		return -1;
+
+	return 0;
+}
+
+static FILE *session_fopen(const char *path, int flags, const char *mode)
+{
+	FILE *f;
+	int fd;
+
+	fd = open(path, flags | O_NOFOLLOW, 0600);
+	if (fd < 0)
+		return NULL;
+
+	f = fdopen(fd, mode);
+	if (! f)
+		close(fd);
+
+	return f;
+}
+
+static int session_read_total(const char *path, unsigned long long *total)
+{
+	FILE *f = session_fopen(path, O_RDONLY, "r");
+	int ret;
+
+	if (! f)
+		return -1;
+
+	ret = fscanf(f, "%llu", total) == 1 ? 0 : -1;
+	fclose(f);
+
+	return ret;
+}
+
+static int session_write_total(const char *path, unsigned long long total)
+{
+	FILE *f = session_fopen(path, O_WRONLY | O_CREAT | O_TRUNC, "w");
+
+	if (! f)
+		return -1;
+
+	fprintf(f, "%llu\n", total);
+
+	return fclose(f) ? -1 : 0;
+}
+
+static int session_feed(void *ctx, const char *data, size_t len)
+{
+	struct session_write *sw = ctx;
+	ssize_t n;
+
+	if (sw->written + len > sw->max)
+		return session_error(400, "more data than announced in Content-Range");
+
+	while (len) {
+		n = write(sw->fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return session_error(errno == ENOSPC ? 507 : 500,
+					     "could not store the upload");
+
+		data += n;
+		len -= n;
+		sw->written += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Run check on the beginning of the staged image, as far as it has
+ * been received. Returns -1 if the image is rejected, -2 if it could
+ * not be checked.
+ */
+static int session_check(int fd, unsigned long long size,
+			 fwupgrade_cgi_check check)
+{
+	size_t need = size < 4096 ? size : 4096;
+	char *buf = NULL, *tmp;
+	ssize_t n;
+	int ret;
+
+	for (;;) {
+		if (! need || need > size)
+			return 0;
+
+		tmp = realloc(buf, need);
+		if (! tmp) {
+			free(buf);
+			session_error(500, "memory allocation problem");
+			return -2;
+		}
+		buf = tmp;
+
+		n = pread(fd, buf, need, 0);
+		if (n < 0 || (size_t) n != need) {
+			free(buf);
+			session_error(500, "could not read the staged upload");
+			return -2;
+		}
+
+		ret = check(buf, need);
+		if (ret <= 0 || (size_t) ret <= need)
+			break;
+
+		need = ret;
+	}
+
+	free(buf);
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Handle a request of an upload session: a piece of the image, a query
+ * of the received size, or the removal of the session. Returns 1 when
+ * the image is complete, with the path of the staged image in path,
+ * 0 when the request has been answered and there is nothing more to
+ * do, or -1 on error.
+ */
+int fwupgrade_session_receive(fwupgrade_cgi_check check,
+			      char *path, size_t path_sz)
+{
+	const char *id = fwupgrade_session_id();
+	char total_path[PATH_MAX], *method, *range;
+	unsigned long long start, end, total, stored;
+	struct session_write sw;
+	struct stat st;
+	int fd, ret;
+
+	method = getenv("REQUEST_METHOD");
+	if (! id || ! method)
+		return session_error(400, "invalid upload session");
+
+	if (session_dir())
+		return session_error(500, "cannot create the staging directory");
+
+	snprintf(path, path_sz, "%s/%s", SESSION_DIR, id);
+	snprintf(total_path, sizeof(total_path), "%s/%s.total", SESSION_DIR, id);
+
+	if (! strcasecmp(method, "get")) {
+		if (lstat(path, & st) || ! S_ISREG(st.st_mode))
+			st.st_size = 0;
+		if (session_read_total(total_path, & total))
+			total = 0;
+
+		fwupgrade_cgi_status(200);
+		printf("session %s\noffset %llu\ntotal %llu\n", id,
+		       (unsigned long long) st.st_size, total);
+		return 0;
+	}
+
+	if (! strcasecmp(method, "delete")) {
+		unlink(path);
+		unlink(total_path);
+
+		fwupgrade_cgi_status(200);
+		printf("Session %s removed\n", id);
+		return 0;
+	}
+
+	range = getenv("HTTP_CONTENT_RANGE");
+	if (! range ||
+	    sscanf(range, "bytes %llu-%llu/%llu", & start, & end, & total) != 3 ||
+	    end < start || end >= total)
+		return session_error(400, "missing or invalid Content-Range");
+
+	if (session_read_total(total_path, & stored)) {
+		if (start != 0) {
+			fwupgrade_cgi_status(416);
+			printf("ERROR: unknown session %s, restart from offset 0.\n", id);
+			return -1;
+		}
+		if (session_write_total(total_path, total))
+			return session_error(500, "cannot create the session");
+	} else if (stored != total)
+		return session_error(400, "total size differs from the session");
+
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+	if (fd < 0 || fstat(fd, & st)) {
+		if (fd >= 0)
+			close(fd);
+		return session_error(500, "cannot open the staging file");
+	}
+
+	/* A piece may overlap what has already been received, when its
+	   acknowledgement was lost, but not leave a hole */
+	if (start > st.st_size) {
+		close(fd);
+		fwupgrade_cgi_status(416);
+		printf("ERROR: expected offset %llu, aborting.\n",
+		       (unsigned long long) st.st_size);
+		return -1;
+	}
+
+	if (ftruncate(fd, start) || lseek(fd, start, SEEK_SET) < 0) {
+		close(fd);
+		return session_error(500, "cannot update the staging file");
+	}
+
+	sw.fd = fd;
+	sw.written = 0;
+	sw.max = end - start + 1;
+
+	/* What was received before an error is kept, for the next
+	   attempt to resume from */
+	ret = fwupgrade_cgi_receive_stream(session_feed, & sw);
+	if (fdatasync(fd) && ! ret)
+		ret = session_error(500, "cannot store the upload");
+
+	if (ret)
+		ret = -2;
+	else
+		ret = session_check(fd, start + sw.written, check);
+
+	close(fd);
+
+	if (ret == -1) {
+		/* The image is rejected, there is no point resuming */
+		unlink(path);
+		unlink(total_path);
+		return -1;
+	}
+
+	if (ret)
+		return -1;
+
+	if (start + sw.written < total) {
+		fwupgrade_cgi_status(200);
+		printf("Received %llu of %llu bytes\n",
+		       start + sw.written, total);
+		return 0;
+	}
+
+	unlink(total_path);
+
+	return 1;
+}
@@ -0,0 +1,12 @@
+#ifndef __FWUPGRADE_SESSION_H__
+#define __FWUPGRADE_SESSION_H__
+
+#include <stddef.h>
+
+#include "fwupgrade-cgi.h"
+
+const char *fwupgrade_session_id(void);
+int fwupgrade_session_receive(fwupgrade_cgi_check check,
+			      char *path, size_t path_sz);
+
+#endif /* __FWUPGRADE_SESSION_H__ */
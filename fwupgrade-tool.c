@@ -6,140 +6,1490 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
-#include <sys/mman.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/sendfile.h>
 
 #include "fwupgrade.h"
+#include "fwupgrade-cache.h"
+#include "fwupgrade-image.h"
+#include "fwupgrade-pool.h"
 
 #define MODE_DUMP     0x42
 #define MODE_EXTRACT  0x43
 
-int dump_or_extract_file(const char *filename, int mode)
+/* Round x up to a multiple of align, a power of two, or 0 for none */
+#define ALIGN_UP(x, align) \
+	((align) ? ((x) + (align) - 1) & ~((uint64_t) (align) - 1) : (x))
+
+/* State shared by the threads building an image */
+struct build_part {
+	const char *spec;      /* name:filename, as given to -p */
+	const char *filename;
+	int         fd;
+};
+
+struct build_chunk {
+	unsigned int part;
+	uint64_t     start;    /* relative to the beginning of the part */
+	uint64_t     length;
+};
+
+struct build {
+	struct fwimage     *image;
+	struct build_part  *parts;
+	struct build_chunk *chunks;
+	unsigned int        chunk_count;
+	int                 outfd;
+	struct fwcache     *cache;     /* digest cache, or NULL */
+};
+
+/* Parts are copied in chunks of this size, so that a single large
+   part is copied by several threads */
+#define BUILD_CHUNK_SZ (64 * 1024 * 1024)
+
+/* Size of the buffers used when the data goes through user space */
+#define BUILD_BUF_SZ (1024 * 1024)
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf    += n;
+		len    -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Compute the MD5 of length bytes of fd starting at offset. The data
+ * is read through a fixed size buffer, so that memory use does not
+ * depend on the length. Returns -1 with errno set on a read error or
+ * if the file is too short.
+ */
+static int md5_range(int fd, uint64_t offset, uint64_t length,
+		     char crc[FWPART_CRC_SZ])
+{
+	struct MD5Context md5ctx;
+	char *buf;
+	ssize_t n;
+
+	buf = malloc(BUILD_BUF_SZ);
+	if (! buf)
+		return -1;
+
+	posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+	MD5Init(& md5ctx);
+	while (length) {
+		n = pread(fd, buf, length > BUILD_BUF_SZ ? BUILD_BUF_SZ : length,
+			  offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			free(buf);
+			return -1;
+		}
+		MD5Update(& md5ctx, (unsigned char *) buf, n);
+		offset += n;
+		length -= n;
+	}
+	MD5Final((unsigned char *) crc, & md5ctx);
+
+	free(buf);
+	return 0;
+}
+
+/* Open a part and compute its MD5 into the image header */
+static int hash_part(void *ctx, unsigned int i)
+{
+	struct build *build = ctx;
+	struct build_part *bp = & build->parts[i];
+	struct fwimage_part *part = & build->image->parts[i];
+	struct stat st;
+
+	bp->fd = open(bp->filename, O_RDONLY);
+	if (bp->fd < 0 || fstat(bp->fd, & st)) {
+		fprintf(stderr, "Cannot open part '%s'\n", bp->spec);
+		return -1;
+	}
+
+	if (st.st_size != part->length) {
+		fprintf(stderr, "Part '%s' changed while reading it\n", bp->spec);
+		return -1;
+	}
+
+	if (build->cache &&
+	    fwcache_lookup(build->cache, bp->filename, & st, part->crc))
+		return 0;
+
+	if (md5_range(bp->fd, 0, part->length, part->crc)) {
+		fprintf(stderr, "Cannot read part '%s': %m\n", bp->spec);
+		return -1;
+	}
+
+	if (build->cache)
+		fwcache_store(build->cache, bp->filename, & st, part->crc);
+
+	return 0;
+}
+
+/*
+ * Copy len bytes of in_fd starting at *in_off to out_fd, at *out_off
+ * or at the current position when out_off is NULL, through a user
+ * space buffer. Used when the kernel cannot do the copy itself. what
+ * names the data in error messages.
+ */
+static int copy_buffered(int in_fd, loff_t *in_off, int out_fd,
+			 loff_t *out_off, uint64_t len, const char *what)
+{
+	char *buf;
+	ssize_t n;
+	int ret = 0;
+
+	buf = malloc(BUILD_BUF_SZ);
+	if (! buf) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return -1;
+	}
+
+	while (len) {
+		n = pread(in_fd, buf, len > BUILD_BUF_SZ ? BUILD_BUF_SZ : len,
+			  *in_off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "Cannot read '%s'\n", what);
+			ret = -1;
+			break;
+		}
+
+		if (out_off ? pwrite_full(out_fd, buf, n, *out_off) :
+			      write_full(out_fd, buf, n)) {
+			fprintf(stderr, "Cannot write '%s': %m\n", what);
+			ret = -1;
+			break;
+		}
+
+		*in_off += n;
+		if (out_off)
+			*out_off += n;
+		len -= n;
+	}
+
+	free(buf);
+	return ret;
+}
+
+/*
+ * Copy len bytes between two files, at the given offsets. The kernel
+ * does the copy with copy_file_range(), which shares the extents on
+ * filesystems supporting reflinks, and the data goes through a buffer
+ * when it cannot.
+ */
+static int copy_range(int in_fd, loff_t in_off, int out_fd, loff_t out_off,
+		      uint64_t len, const char *what)
+{
+	ssize_t n;
+
+	while (len) {
+		n = copy_file_range(in_fd, & in_off, out_fd, & out_off, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len -= n;
+	}
+
+	if (len)
+		return copy_buffered(in_fd, & in_off, out_fd, & out_off, len, what);
+
+	return 0;
+}
+
+static int build_chunks(struct build *build)
+{
+	struct fwimage *image = build->image;
+	uint64_t start;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < image->part_count; i++)
+		n += (image->parts[i].length + BUILD_CHUNK_SZ - 1) / BUILD_CHUNK_SZ;
+
+	build->chunks = calloc(n ? n : 1, sizeof(struct build_chunk));
+	if (! build->chunks) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < image->part_count; i++) {
+		for (start = 0; start < image->parts[i].length; start += BUILD_CHUNK_SZ) {
+			struct build_chunk *chunk = & build->chunks[build->chunk_count++];
+
+			chunk->part   = i;
+			chunk->start  = start;
+			chunk->length = image->parts[i].length - start;
+			if (chunk->length > BUILD_CHUNK_SZ)
+				chunk->length = BUILD_CHUNK_SZ;
+		}
+	}
+
+	return 0;
+}
+
+/* Copy one chunk of a part to its place in the output file */
+static int copy_chunk(void *ctx, unsigned int i)
+{
+	struct build *build = ctx;
+	struct build_chunk *chunk = & build->chunks[i];
+	struct build_part *bp = & build->parts[chunk->part];
+	struct fwimage_part *part = & build->image->parts[chunk->part];
+
+	return copy_range(bp->fd, chunk->start, build->outfd,
+			  part->offset + chunk->start, chunk->length, bp->spec);
+}
+
+/*
+ * Move len bytes inside the image file from offset "from" to offset
+ * "to". The ranges may overlap: the data is moved in chunks no larger
+ * than the distance, starting from the end that does not overwrite
+ * data still to be moved.
+ */
+static int move_data(int fd, uint64_t from, uint64_t to, uint64_t len,
+		     const char *what)
+{
+	uint64_t dist = to > from ? to - from : from - to;
+	uint64_t chunk = dist < BUILD_CHUNK_SZ ? dist : BUILD_CHUNK_SZ;
+	uint64_t pos, n;
+	loff_t in_off, out_off;
+	ssize_t ret;
+
+	if (! dist)
+		return 0;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = len - pos < chunk ? len - pos : chunk;
+
+		/* Moving towards the end of the file, start with the
+		   last chunk */
+		in_off  = to > from ? from + len - pos - n : from + pos;
+		out_off = to > from ? to + len - pos - n : to + pos;
+
+		ret = copy_file_range(fd, & in_off, fd, & out_off, n, 0);
+		if (ret < 0)
+			ret = 0;
+
+		if (ret < n &&
+		    copy_buffered(fd, & in_off, fd, & out_off, n - ret, what))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read and parse the header of the image open on fd, without reading
+ * the part data.
+ */
+static int read_header(int fd, struct fwimage *image)
+{
+	uint64_t len = sizeof(struct fwheader);
+	void *buf = NULL, *tmp;
+	ssize_t n;
+	int ret;
+
+	for (;;) {
+		tmp = realloc(buf, len);
+		if (! tmp) {
+			ret = FWIMAGE_ENOMEM;
+			break;
+		}
+		buf = tmp;
+
+		n = pread(fd, buf, len, 0);
+		if (n < 0) {
+			ret = FWIMAGE_ETRUNC;
+			break;
+		}
+
+		ret = fwimage_parse(buf, n, image);
+		if (ret != FWIMAGE_ETRUNC || n < len ||
+		    le32toh(*(uint32_t *) buf) != FWUPGRADE_MAGIC_V2)
+			break;
+
+		/* The part table of a version 2 header is larger */
+		len = fwimage_header_size(2, le32toh(((struct fwheader_v2 *) buf)->part_count));
+		if (len <= n)
+			break;
+	}
+
+	free(buf);
+	return ret;
+}
+
+/*
+ * Replace or add (spec is name:filename) or remove (remove is the
+ * part name) one part of an existing image, in place. The digests of
+ * the other parts are taken from the header, and their data is only
+ * moved when the change shifts their offset. The result is the same
+ * as creating the image again with the new set of parts.
+ */
+static int repack_image(const char *filename, const char *spec,
+			const char *remove, unsigned int version,
+			unsigned int align, struct fwcache *cache)
+{
+	struct fwimage old, new;
+	struct build build;
+	struct stat st;
+	uint64_t *old_offsets, offset, total_size;
+	static const char zeroes[4096];
+	unsigned int i, target, count;
+	const char *name;
+	size_t name_len;
+	void *header;
+	int fd, ret;
+
+	fd = open(filename, O_RDWR);
+	if (fd < 0 || fstat(fd, & st)) {
+		fprintf(stderr, "Cannot open image '%s': %m\n", filename);
+		return -1;
+	}
+
+	ret = read_header(fd, & old);
+	if (ret == 0 && old.size > st.st_size) {
+		fwimage_release(& old);
+		ret = FWIMAGE_ETRUNC;
+	}
+	if (ret) {
+		fprintf(stderr, "Invalid firmware file: %s\n", fwimage_strerror(ret));
+		return -1;
+	}
+
+	name = spec ? spec : remove;
+	name_len = spec ? strcspn(spec, ":") : strlen(remove);
+	if (spec && ! spec[name_len]) {
+		fprintf(stderr, "Incorrect part syntax: '%s'\n", spec);
+		return -1;
+	}
+	if (name_len + 1 > FWPART_NAME_SZ) {
+		fprintf(stderr, "Name too long in part: '%s'\n", name);
+		return -1;
+	}
+
+	for (target = 0; target < old.part_count; target++)
+		if (strlen(old.parts[target].name) == name_len &&
+		    ! strncmp(old.parts[target].name, name, name_len))
+			break;
+
+	if (remove && target == old.part_count) {
+		fprintf(stderr, "No part named '%s' in the image\n", remove);
+		return -1;
+	}
+
+	/* Build the new part list, remembering where the data of each
+	   part currently is, or 0 for the new data */
+	new = old;
+	new.parts = calloc(old.part_count + 1, sizeof(struct fwimage_part));
+	old_offsets = calloc(old.part_count + 1, sizeof(uint64_t));
+	build.parts = calloc(old.part_count + 1, sizeof(struct build_part));
+	if (! new.parts || ! old_offsets || ! build.parts) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return -1;
+	}
+
+	for (i = 0, count = 0; i < old.part_count; i++) {
+		if (remove && i == target)
+			continue;
+		new.parts[count] = old.parts[i];
+		old_offsets[count] = old.parts[i].offset;
+		count++;
+	}
+
+	if (spec) {
+		struct build_part *bp = & build.parts[target];
+
+		if (target == old.part_count) {
+			memset(& new.parts[target], 0, sizeof(struct fwimage_part));
+			memcpy(new.parts[target].name, name, name_len);
+			count++;
+		}
+		old_offsets[target] = 0;
+
+		bp->spec     = spec;
+		bp->filename = spec + name_len + 1;
+		if (stat(bp->filename, & st)) {
+			fprintf(stderr, "Cannot find part '%s'\n", spec);
+			return -1;
+		}
+		new.parts[target].length = st.st_size;
+
+		build.image = & new;
+		build.cache = cache;
+		if (hash_part(& build, target))
+			return -1;
+	}
+
+	new.part_count = count;
+	if (align)
+		new.align = align;
+
+	/* Keep the version of the image, unless the new parts do not
+	   fit in a version 1 image */
+	total_size = fwimage_header_size(1, 0);
+	for (i = 0; i < count; i++)
+		total_size = ALIGN_UP(total_size, new.align) + new.parts[i].length;
+
+	if (! version) {
+		version = old.version;
+		if (count > FWPART_COUNT || total_size > UINT32_MAX)
+			version = 2;
+	} else if (version == 1 &&
+		   (count > FWPART_COUNT || total_size > UINT32_MAX)) {
+		fprintf(stderr, "Parts do not fit in a version 1 image\n");
+		return -1;
+	}
+
+	new.version = version;
+	new.header_size = fwimage_header_size(version, count);
+
+	offset = new.header_size;
+	for (i = 0; i < count; i++) {
+		new.parts[i].offset = ALIGN_UP(offset, new.align);
+		offset = new.parts[i].offset + new.parts[i].length;
+	}
+
+	/* Parts moving towards the beginning of the file are moved
+	   first, in order, then the parts moving towards the end, in
+	   reverse order, so that no data is overwritten before being
+	   moved */
+	for (i = 0; i < count; i++)
+		if (old_offsets[i] && new.parts[i].offset < old_offsets[i] &&
+		    move_data(fd, old_offsets[i], new.parts[i].offset,
+			      new.parts[i].length, filename))
+			return -1;
+
+	for (i = count; i-- > 0; )
+		if (old_offsets[i] && new.parts[i].offset > old_offsets[i] &&
+		    move_data(fd, old_offsets[i], new.parts[i].offset,
+			      new.parts[i].length, filename))
+			return -1;
+
+	/* Copy the new data in place */
+	if (spec) {
+		struct build_part *bp = & build.parts[target];
+
+		if (copy_range(bp->fd, 0, fd, new.parts[target].offset,
+			       new.parts[target].length, bp->spec))
+			return -1;
+
+		close(bp->fd);
+	}
+
+	/* Zero the alignment gaps, which may contain stale data */
+	offset = new.header_size;
+	for (i = 0; i < count; i++) {
+		while (offset < new.parts[i].offset) {
+			size_t n = new.parts[i].offset - offset;
+
+			if (n > sizeof(zeroes))
+				n = sizeof(zeroes);
+			if (pwrite_full(fd, zeroes, n, offset))
+				goto error;
+			offset += n;
+		}
+
+		offset += new.parts[i].length;
+	}
+
+	header = malloc(new.header_size);
+	if (! header) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return -1;
+	}
+
+	fwimage_build_header(& new, header);
+
+	if (pwrite_full(fd, header, new.header_size, 0) ||
+	    ftruncate(fd, offset) || close(fd))
+		goto error;
+
+	free(header);
+	free(old_offsets);
+	free(build.parts);
+	free(new.parts);
+	fwimage_release(& old);
+
+	return 0;
+
+error:
+	fprintf(stderr, "Cannot write image '%s': %m\n", filename);
+	return -1;
+}
+
+/*
+ * Write the image to a pipe or any other output that cannot seek:
+ * the header, whose digests are already known, then each part
+ * preceded by its alignment padding. sendfile() moves the data
+ * without copying it through user space when possible.
+ */
+static int stream_image(struct build *build, int out_fd)
+{
+	struct fwimage *image = build->image;
+	static const char zeroes[4096];
+	uint64_t offset, remaining, n;
+	unsigned int i;
+	ssize_t sent;
+	void *header;
+	int ret;
+
+	header = malloc(image->header_size);
+	if (! header) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return -1;
+	}
+
+	fwimage_build_header(image, header);
+	ret = write_full(out_fd, header, image->header_size);
+	free(header);
+	if (ret)
+		goto error;
+
+	offset = image->header_size;
+	for (i = 0; i < image->part_count; i++) {
+		struct build_part *bp = & build->parts[i];
+		struct fwimage_part *part = & image->parts[i];
+		loff_t in_off = 0;
+
+		for (; offset < part->offset; offset += n) {
+			n = part->offset - offset;
+			if (n > sizeof(zeroes))
+				n = sizeof(zeroes);
+			if (write_full(out_fd, zeroes, n))
+				goto error;
+		}
+
+		remaining = part->length;
+		while (remaining) {
+			sent = sendfile(out_fd, bp->fd, & in_off, remaining);
+			if (sent < 0 && errno == EINTR)
+				continue;
+			if (sent <= 0)
+				break;
+			remaining -= sent;
+		}
+
+		if (remaining &&
+		    copy_buffered(bp->fd, & in_off, out_fd, NULL, remaining,
+				  bp->spec))
+			return -1;
+
+		offset += part->length;
+	}
+
+	return 0;
+
+error:
+	fprintf(stderr, "Cannot write the image: %m\n");
+	return -1;
+}
+
+/*
+ * Fill image and build from the name:filename specifications of the
+ * parts: names, sizes, version and layout of the image. The digests
+ * are computed later, by hash_part().
+ */
+static int setup_image(struct fwimage *image, struct build *build,
+		       char **parts, unsigned int part_count,
+		       unsigned int hwid, unsigned int version,
+		       unsigned int align)
+{
+	uint64_t current_offset, total_size;
+	unsigned int i;
+
+	if (version == 1 && part_count > FWPART_COUNT) {
+		fprintf(stderr, "Too many parts for a version 1 image\n");
+		return -1;
+	}
+
+	memset(image, 0, sizeof(*image));
+
+	image->hwid       = hwid;
+	image->flags      = 0;
+	image->part_count = part_count;
+	image->parts      = calloc(part_count, sizeof(struct fwimage_part));
+	build->image      = image;
+	build->parts      = calloc(part_count, sizeof(struct build_part));
+	if (! image->parts || ! build->parts) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return -1;
+	}
+
+	/* First, we extract the name:filename informations and get
+	   the part sizes, which tell which image version we need */
+	for (i = 0; i < part_count; i++) {
+		struct stat s;
+		char *filename, *tmp;
+		int name_len;
+
+		tmp = strchr(parts[i], ':');
+		if (! tmp) {
+			fprintf(stderr, "Incorrect part syntax: '%s'\n",
+				parts[i]);
+			return -1;
+		}
+
+		name_len = tmp - parts[i];
+
+		if (name_len + 1 > FWPART_NAME_SZ) {
+			fprintf(stderr, "Name too long in part: '%s'\n",
+				parts[i]);
+			return -1;
+		}
+
+		/* Fill the name information of the part header */
+		strncpy(image->parts[i].name, parts[i], name_len);
+		image->parts[i].name[name_len] = '\0';
+
+		/* Skip the ':' to get the filename */
+		filename = tmp + 1;
+
+		/* Get the file size */
+		if (stat(filename, & s)) {
+			fprintf(stderr, "Cannot find part '%s'\n", parts[i]);
+			return -1;
+		}
+
+		image->parts[i].length = s.st_size;
+
+		build->parts[i].spec     = parts[i];
+		build->parts[i].filename = filename;
+		build->parts[i].fd       = -1;
+	}
+
+	/* A version 1 image has at most FWPART_COUNT parts and 32 bits
+	   sizes and offsets */
+	total_size = fwimage_header_size(1, 0);
+	for (i = 0; i < part_count; i++)
+		total_size = ALIGN_UP(total_size, align) + image->parts[i].length;
+	if (! version) {
+		version = 1;
+		if (part_count > FWPART_COUNT || total_size > UINT32_MAX)
+			version = 2;
+	} else if (version == 1 && total_size > UINT32_MAX) {
+		fprintf(stderr, "Image too large for version 1\n");
+		return -1;
+	}
+
+	image->version = version;
+	image->align = align;
+	image->header_size = fwimage_header_size(version, part_count);
+
+	/* Compute the offset of each part: the layout of the image is
+	   known before any data is read, so that the parts can be
+	   hashed and copied in parallel */
+	current_offset = image->header_size;
+	for (i = 0; i < part_count; i++) {
+		struct fwimage_part *part = & image->parts[i];
+
+		part->offset = ALIGN_UP(current_offset, align);
+		current_offset = part->offset + part->length;
+	}
+
+	image->size = current_offset;
+
+	return 0;
+}
+
+static void print_parts(FILE *log, struct build *build)
+{
+	unsigned int i;
+
+	for (i = 0; i < build->image->part_count; i++) {
+		struct fwimage_part *part = & build->image->parts[i];
+
+		fprintf(log, "part[%d], name=%s, filename=%s, size=%llu, offset=%llu, md5=%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx\n",
+			i, part->name, build->parts[i].filename,
+			(unsigned long long) part->length,
+			(unsigned long long) part->offset,
+			part->crc[0], part->crc[1],
+			part->crc[2], part->crc[3],
+			part->crc[4], part->crc[5],
+			part->crc[6], part->crc[7],
+			part->crc[8], part->crc[9],
+			part->crc[10], part->crc[11],
+			part->crc[12], part->crc[13],
+			part->crc[14], part->crc[15]);
+	}
+}
+
+/*
+ * Create the output file of an image whose digests are known: write
+ * the header, size the file so that the alignment gaps read as
+ * zeroes, and prepare the chunks that copy_chunk() copies at their
+ * offsets.
+ */
+static int open_output(struct build *build, const char *output)
+{
+	struct fwimage *image = build->image;
+	void *header;
+	int ret;
+
+	header = malloc(image->header_size);
+	if (! header) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return -1;
+	}
+
+	fwimage_build_header(image, header);
+
+	build->outfd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (build->outfd < 0) {
+		fprintf(stderr, "Cannot open output file %s: %m\n", output);
+		free(header);
+		return -1;
+	}
+
+	ret = pwrite_full(build->outfd, header, image->header_size, 0) ||
+		ftruncate(build->outfd, image->size);
+	free(header);
+
+	if (ret) {
+		fprintf(stderr, "Cannot write output file %s: %m\n", output);
+		return -1;
+	}
+
+	return build_chunks(build);
+}
+
+/* One image of a batch, as described by a line of the manifest */
+struct batch_image {
+	char          *line;
+	char          *output;
+	char         **parts;
+	unsigned int   part_count;
+	unsigned int  *files;      /* index of each part in the distinct files */
+	struct fwimage image;
+	struct build   build;
+};
+
+struct batch_job {
+	struct build *build;
+	unsigned int  chunk;
+};
+
+static int batch_copy(void *ctx, unsigned int i)
+{
+	struct batch_job *job = (struct batch_job *) ctx + i;
+
+	return copy_chunk(job->build, job->chunk);
+}
+
+/* Parse one manifest line, "output-file HWID name:file ..." */
+static int batch_parse_line(struct batch_image *bi, char *line,
+			    unsigned int *hwid)
+{
+	char *tok, *end;
+	char **tmp;
+
+	bi->line = line;
+
+	bi->output = strtok(line, " \t");
+	tok = strtok(NULL, " \t");
+	if (! tok)
+		return -1;
+
+	*hwid = strtoul(tok, & end, 16);
+	if (*end || ! *hwid)
+		return -1;
+
+	while ((tok = strtok(NULL, " \t"))) {
+		tmp = realloc(bi->parts, (bi->part_count + 1) * sizeof(char *));
+		if (! tmp)
+			return -1;
+		bi->parts = tmp;
+		bi->parts[bi->part_count++] = tok;
+	}
+
+	return bi->part_count ? 0 : -1;
+}
+
+/*
+ * Build all the images described by a manifest. A part file shared by
+ * several images is hashed once: the files are identified by device
+ * and inode, and hashed on the thread pool before any image is
+ * written. The chunks of all the images are then copied by a single
+ * run of the pool.
+ */
+static int build_batch(const char *manifest, unsigned int version,
+		       unsigned int align, unsigned int jobs,
+		       struct fwcache *cache, int verbose)
+{
+	struct batch_image *images = NULL, *tmpimages;
+	unsigned int image_count = 0, file_count = 0, job_count = 0;
+	struct fwimage files_image;
+	struct build files;
+	struct batch_job *batch_jobs;
+	struct stat *file_st = NULL;
+	char *line = NULL;
+	size_t linesz = 0;
+	unsigned int i, j, k, hwid, lineno = 0;
+	int ret = -1;
+	FILE *f;
+
+	f = fopen(manifest, "r");
+	if (! f) {
+		fprintf(stderr, "Cannot open manifest %s: %m\n", manifest);
+		return -1;
+	}
+
+	while (getline(& line, & linesz, f) > 0) {
+		struct batch_image *bi;
+
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0')
+			continue;
+
+		tmpimages = realloc(images, (image_count + 1) * sizeof(*images));
+		if (! tmpimages) {
+			fprintf(stderr, "Cannot allocate memory\n");
+			goto out;
+		}
+		images = tmpimages;
+		bi = & images[image_count++];
+		memset(bi, 0, sizeof(*bi));
+
+		if (batch_parse_line(bi, line, & hwid)) {
+			fprintf(stderr, "Invalid manifest line %u\n", lineno);
+			goto out;
+		}
+
+		if (setup_image(& bi->image, & bi->build, bi->parts,
+				bi->part_count, hwid, version, align))
+			goto out;
+
+		/* The tokens point into the line, keep it */
+		line = NULL;
+		linesz = 0;
+	}
+
+	if (! image_count) {
+		fprintf(stderr, "No image in manifest %s\n", manifest);
+		goto out;
+	}
+
+	/* Find the distinct part files */
+	memset(& files_image, 0, sizeof(files_image));
+	memset(& files, 0, sizeof(files));
+	files.image = & files_image;
+	files.cache = cache;
+
+	for (i = 0; i < image_count; i++) {
+		struct batch_image *bi = & images[i];
+
+		bi->files = calloc(bi->part_count, sizeof(unsigned int));
+		if (! bi->files) {
+			fprintf(stderr, "Cannot allocate memory\n");
+			goto out;
+		}
+
+		for (j = 0; j < bi->part_count; j++) {
+			struct build_part *bp = & bi->build.parts[j];
+			struct stat st;
+
+			if (stat(bp->filename, & st)) {
+				fprintf(stderr, "Cannot find part '%s'\n", bp->spec);
+				goto out;
+			}
+
+			for (k = 0; k < file_count; k++)
+				if (file_st[k].st_dev == st.st_dev &&
+				    file_st[k].st_ino == st.st_ino)
+					break;
+
+			if (k == file_count) {
+				void *p1 = realloc(file_st, (k + 1) * sizeof(*file_st));
+				void *p2 = p1 ? realloc(files.parts, (k + 1) * sizeof(*files.parts)) : NULL;
+				void *p3 = p2 ? realloc(files_image.parts, (k + 1) * sizeof(*files_image.parts)) : NULL;
+
+				if (p1)
+					file_st = p1;
+				if (p2)
+					files.parts = p2;
+				if (! p3) {
+					fprintf(stderr, "Cannot allocate memory\n");
+					goto out;
+				}
+				files_image.parts = p3;
+
+				file_st[k] = st;
+				files.parts[k] = *bp;
+				files_image.parts[k] = bi->image.parts[j];
+				file_count++;
+			}
+
+			bi->files[j] = k;
+		}
+	}
+
+	files_image.part_count = file_count;
+
+	if (fwpool_run(jobs, file_count, hash_part, & files))
+		goto out;
+
+	/* Hand the digests and the open files to the images, and create
+	   the output files */
+	for (i = 0; i < image_count; i++) {
+		struct batch_image *bi = & images[i];
+
+		for (j = 0; j < bi->part_count; j++) {
+			k = bi->files[j];
+			if (bi->image.parts[j].length != files_image.parts[k].length) {
+				fprintf(stderr, "Part '%s' changed while reading it\n",
+					bi->build.parts[j].spec);
+				goto out;
+			}
+			memcpy(bi->image.parts[j].crc, files_image.parts[k].crc,
+			       FWPART_CRC_SZ);
+			bi->build.parts[j].fd = files.parts[k].fd;
+		}
+
+		if (verbose) {
+			printf("image %s, hwid=0x%x\n", bi->output, bi->image.hwid);
+			print_parts(stdout, & bi->build);
+		}
+
+		if (open_output(& bi->build, bi->output))
+			goto out;
+
+		job_count += bi->build.chunk_count;
+	}
+
+	batch_jobs = calloc(job_count ? job_count : 1, sizeof(*batch_jobs));
+	if (! batch_jobs) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		goto out;
+	}
+
+	for (i = 0, k = 0; i < image_count; i++)
+		for (j = 0; j < images[i].build.chunk_count; j++, k++) {
+			batch_jobs[k].build = & images[i].build;
+			batch_jobs[k].chunk = j;
+		}
+
+	ret = fwpool_run(jobs, job_count, batch_copy, batch_jobs);
+	free(batch_jobs);
+
+	for (i = 0; i < image_count; i++) {
+		if (close(images[i].build.outfd) && ! ret) {
+			fprintf(stderr, "Cannot write output file %s: %m\n",
+				images[i].output);
+			ret = -1;
+		}
+		images[i].build.outfd = -1;
+	}
+
+out:
+	fclose(f);
+	free(line);
+	free(file_st);
+	return ret;
+}
+
+/*
+ * Comparison of two images, to estimate what an upgrade from the old
+ * one to the new one changes on the flash. Parts are matched by name
+ * and compared one erase block at a time, relative to the beginning
+ * of the part since that is where it is flashed.
+ */
+struct diff_job {
+	unsigned int part;         /* index in the new image */
+	uint64_t     start;        /* relative to the beginning of the part */
+	uint64_t     length;
+	uint64_t     changed_bytes;
+	uint64_t     changed_blocks;
+};
+
+struct diff {
+	struct fwimage  *old, *new;
+	int              old_fd, new_fd;
+	int             *old_part;  /* matching old part, or -1 */
+	unsigned int     block_size;
+	struct diff_job *jobs;
+};
+
+/* Count the differing bytes of two buffers */
+static uint64_t diff_count(const unsigned char *a, const unsigned char *b,
+			   size_t len)
+{
+	uint64_t count = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		count += a[i] != b[i];
+
+	return count;
+}
+
+static int diff_chunk(void *ctx, unsigned int i)
+{
+	struct diff *diff = ctx;
+	struct diff_job *job = & diff->jobs[i];
+	struct fwimage_part *np = & diff->new->parts[job->part];
+	struct fwimage_part *op = NULL;
+	unsigned char *nbuf, *obuf;
+	uint64_t pos, n, common;
+	int ret = -1;
+
+	if (diff->old_part[job->part] >= 0)
+		op = & diff->old->parts[diff->old_part[job->part]];
+
+	nbuf = malloc(diff->block_size);
+	obuf = malloc(diff->block_size);
+	if (! nbuf || ! obuf) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		goto out;
+	}
+
+	for (pos = job->start; pos < job->start + job->length; pos += n) {
+		n = job->start + job->length - pos;
+		if (n > diff->block_size)
+			n = diff->block_size;
+
+		/* Bytes past the end of the old part are all new */
+		common = 0;
+		if (op && pos < op->length)
+			common = op->length - pos < n ? op->length - pos : n;
+
+		if (pread(diff->new_fd, nbuf, n, np->offset + pos) != n ||
+		    (common &&
+		     pread(diff->old_fd, obuf, common, op->offset + pos) != common)) {
+			fprintf(stderr, "Cannot read part %s\n", np->name);
+			goto out;
+		}
+
+		if (common == n && ! memcmp(nbuf, obuf, n))
+			continue;
+
+		job->changed_blocks++;
+		job->changed_bytes += diff_count(nbuf, obuf, common) + n - common;
+	}
+
+	ret = 0;
+
+out:
+	free(nbuf);
+	free(obuf);
+	return ret;
+}
+
+/* Flash time of a number of erase blocks and bytes, in seconds */
+static double diff_time(uint64_t blocks, uint64_t bytes,
+			double erase_ms, double program_kbps)
+{
+	return blocks * erase_ms / 1000 + bytes / (program_kbps * 1024);
+}
+
+/*
+ * Compare two images and report the bytes and erase blocks of each
+ * part that differ, with the estimated flash time of the upgrade as
+ * it is done today (every block of each part is erased and
+ * programmed) and of the changed blocks alone.
+ */
+static int diff_images(const char *oldfile, const char *newfile,
+		       unsigned int block_size, double erase_ms,
+		       double program_kbps, unsigned int jobs)
 {
-	void *addr;
+	struct fwimage old, new;
+	struct diff diff;
 	struct stat s;
-	int ret, fd, i;
-	struct fwheader *header;
+	uint64_t start, bytes = 0, blocks = 0, changed_bytes = 0, changed_blocks = 0;
+	unsigned int i, j, job_count = 0, chunk_blocks;
+	const char *files[2] = { oldfile, newfile };
+	struct fwimage *images[2] = { & old, & new };
+	int fds[2];
 
-	ret = stat(filename, &s);
-	if (ret) {
-		fprintf(stderr, "Error while stat()ing file: %m\n");
-		return -1;
+	for (i = 0; i < 2; i++) {
+		int ret;
+
+		fds[i] = open(files[i], O_RDONLY);
+		if (fds[i] < 0 || fstat(fds[i], & s)) {
+			fprintf(stderr, "Cannot open image '%s': %m\n", files[i]);
+			return -1;
+		}
+
+		ret = read_header(fds[i], images[i]);
+		if (ret == 0 && images[i]->size > s.st_size) {
+			fwimage_release(images[i]);
+			ret = FWIMAGE_ETRUNC;
+		}
+		if (ret) {
+			fprintf(stderr, "Invalid firmware file '%s': %s\n", files[i],
+				fwimage_strerror(ret));
+			return -1;
+		}
+
+		posix_fadvise(fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
 	}
 
-	fd = open(filename, O_RDONLY);;
-	if (fd < 0) {
-		fprintf(stderr, "Error while opening file: %m\n");
+	diff.old        = & old;
+	diff.new        = & new;
+	diff.old_fd     = fds[0];
+	diff.new_fd     = fds[1];
+	diff.block_size = block_size;
+	diff.old_part   = calloc(new.part_count ? new.part_count : 1, sizeof(int));
+	if (! diff.old_part) {
+		fprintf(stderr, "Cannot allocate memory\n");
 		return -1;
 	}
 
-	addr = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (addr == MAP_FAILED) {
-		fprintf(stderr, "Error while mapping file: %m\n");
-		close(fd);
+	/* Each job compares a range of whole blocks of one part */
+	chunk_blocks = BUILD_CHUNK_SZ / block_size ? BUILD_CHUNK_SZ / block_size : 1;
+
+	for (i = 0; i < new.part_count; i++) {
+		diff.old_part[i] = -1;
+		for (j = 0; j < old.part_count; j++)
+			if (! strcmp(new.parts[i].name, old.parts[j].name))
+				diff.old_part[i] = j;
+
+		job_count += (new.parts[i].length + (uint64_t) chunk_blocks * block_size - 1) /
+			((uint64_t) chunk_blocks * block_size);
+	}
+
+	diff.jobs = calloc(job_count ? job_count : 1, sizeof(struct diff_job));
+	if (! diff.jobs) {
+		fprintf(stderr, "Cannot allocate memory\n");
 		return -1;
 	}
 
-	header = addr;
+	for (i = 0, j = 0; i < new.part_count; i++) {
+		for (start = 0; start < new.parts[i].length;
+		     start += (uint64_t) chunk_blocks * block_size, j++) {
+			diff.jobs[j].part   = i;
+			diff.jobs[j].start  = start;
+			diff.jobs[j].length = new.parts[i].length - start;
+			if (diff.jobs[j].length > (uint64_t) chunk_blocks * block_size)
+				diff.jobs[j].length = (uint64_t) chunk_blocks * block_size;
+		}
+	}
 
-	if (le32toh(header->magic) != FWUPGRADE_MAGIC) {
-		fprintf(stderr, "Unrecognized firmware file, invalid magic\n");
+	if (fwpool_run(jobs, job_count, diff_chunk, & diff))
 		return -1;
+
+	for (i = 0, j = 0; i < new.part_count; i++) {
+		struct fwimage_part *part = & new.parts[i];
+		uint64_t part_bytes = 0, part_blocks = 0;
+		uint64_t nblocks = (part->length + block_size - 1) / block_size;
+
+		for (; j < job_count && diff.jobs[j].part == i; j++) {
+			part_bytes  += diff.jobs[j].changed_bytes;
+			part_blocks += diff.jobs[j].changed_blocks;
+		}
+
+		printf("part %s: size=%llu, changed bytes=%llu, changed blocks=%llu/%llu%s\n",
+		       part->name, (unsigned long long) part->length,
+		       (unsigned long long) part_bytes,
+		       (unsigned long long) part_blocks,
+		       (unsigned long long) nblocks,
+		       diff.old_part[i] < 0 ? " (new part)" : "");
+
+		bytes          += part->length;
+		blocks         += nblocks;
+		changed_bytes  += part_bytes;
+		changed_blocks += part_blocks;
 	}
 
-	if (mode == MODE_DUMP) {
-		printf("HWID    : 0x%x\n", le32toh(header->hwid));
-		printf("Flags   : 0x%x\n", le32toh(header->flags));
+	for (j = 0; j < old.part_count; j++) {
+		for (i = 0; i < new.part_count; i++)
+			if (diff.old_part[i] == j)
+				break;
+		if (i == new.part_count)
+			printf("part %s: removed\n", old.parts[j].name);
 	}
 
-	for (i = 0; i < FWPART_COUNT; i++) {
-		unsigned int sz, offset;
+	printf("total: changed bytes=%llu/%llu, changed blocks=%llu/%llu\n",
+	       (unsigned long long) changed_bytes, (unsigned long long) bytes,
+	       (unsigned long long) changed_blocks, (unsigned long long) blocks);
+	printf("estimated flash time: %.1f s for the full upgrade, %.1f s for the changed blocks\n",
+	       diff_time(blocks, bytes, erase_ms, program_kbps),
+	       diff_time(changed_blocks, changed_blocks * block_size,
+			 erase_ms, program_kbps));
+
+	free(diff.jobs);
+	free(diff.old_part);
+	fwimage_release(& old);
+	fwimage_release(& new);
+	close(fds[0]);
+	close(fds[1]);
+
+	return 0;
+}
+
+/* State shared by the threads dumping or extracting an image */
+struct extract {
+	struct fwimage *image;
+	int             fd;
+	int             mode;
+	int             verify;
+	char           *selected;  /* parts to process, indexed like image->parts */
+	const char     *outdir;
+};
+
+/* Verify and, when extracting, copy one part of the image to a file */
+static int extract_part(void *ctx, unsigned int i)
+{
+	struct extract *ex = ctx;
+	struct fwimage_part *part = & ex->image->parts[i];
+	char *extracted_file_name;
+	int out, ret;
+
+	if (! ex->selected[i])
+		return 0;
+
+	if (ex->verify) {
 		char computed_crc[FWPART_CRC_SZ];
 
-		sz = le32toh(header->parts[i].length);
-		offset = le32toh(header->parts[i].offset);
-		if (! sz)
-			continue;
+		if (md5_range(ex->fd, part->offset, part->length, computed_crc)) {
+			fprintf(stderr, "Cannot read part %d: %m\n", i);
+			return -1;
+		}
 
-		md5(addr + offset, sz, computed_crc);
-		if (memcmp(computed_crc, header->parts[i].crc, FWPART_CRC_SZ)) {
+		if (memcmp(computed_crc, part->crc, FWPART_CRC_SZ)) {
 			fprintf(stderr, "CRC for part %d do not match\n", i);
 			return -1;
 		}
+	}
+
+	if (ex->mode != MODE_EXTRACT)
+		return 0;
+
+	if (asprintf(& extracted_file_name, "%s/extracted-%s.img",
+		     ex->outdir, part->name) < 0) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return -1;
+	}
+
+	out = open(extracted_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		fprintf(stderr, "Cannot open output file %s\n",
+			extracted_file_name);
+		free(extracted_file_name);
+		return -1;
+	}
+
+	ret = copy_range(ex->fd, part->offset, out, 0, part->length,
+			 extracted_file_name);
+	if (close(out) && ! ret) {
+		fprintf(stderr, "Cannot write output file %s\n",
+			extracted_file_name);
+		ret = -1;
+	}
+
+	free(extracted_file_name);
+	return ret;
+}
+
+/*
+ * Dump the header of an image or extract its parts to outdir. names
+ * selects the parts to process, all of them when name_count is 0.
+ * Unless verify is 0, the selected parts are checked against their
+ * MD5; otherwise, dumping only reads the header.
+ */
+int dump_or_extract_file(const char *filename, int mode, char **names,
+			 unsigned int name_count, const char *outdir,
+			 int verify, unsigned int jobs)
+{
+	struct extract ex;
+	struct fwimage image;
+	struct stat s;
+	unsigned int i, j;
+	int ret, fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, & s)) {
+		fprintf(stderr, "Error while opening file: %m\n");
+		return -1;
+	}
+
+	ret = read_header(fd, & image);
+	if (ret == FWIMAGE_EMAGIC) {
+		fprintf(stderr, "Unrecognized firmware file, invalid magic\n");
+		return -1;
+	} else if (ret == 0 && image.size > s.st_size) {
+		fwimage_release(& image);
+		ret = FWIMAGE_ETRUNC;
+	}
+
+	if (ret) {
+		fprintf(stderr, "Invalid firmware file: %s\n", fwimage_strerror(ret));
+		return -1;
+	}
+
+	ex.image    = & image;
+	ex.fd       = fd;
+	ex.mode     = mode;
+	ex.verify   = verify;
+	ex.outdir   = outdir ? outdir : ".";
+	ex.selected = calloc(image.part_count ? image.part_count : 1, 1);
+	if (! ex.selected) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return -1;
+	}
 
-		if (mode == MODE_DUMP) {
-			printf("part[%d] : name=%s, size=%d, offset=%d\n",
-			       i, header->parts[i].name, sz, offset);
+	for (i = 0; i < image.part_count; i++)
+		ex.selected[i] = name_count == 0;
+
+	for (j = 0; j < name_count; j++) {
+		for (i = 0; i < image.part_count; i++)
+			if (! strcmp(image.parts[i].name, names[j]))
+				break;
+
+		if (i == image.part_count) {
+			fprintf(stderr, "No part named '%s' in the image\n", names[j]);
+			return -1;
 		}
-		else if (mode == MODE_EXTRACT) {
-			char *extracted_file_name;
-			FILE *extracted_file;
+		ex.selected[i] = 1;
+	}
 
-			if (asprintf(& extracted_file_name, "extracted-%s.img",
-				     header->parts[i].name) < 0)
-			{
-				fprintf(stderr, "Cannot allocate memory\n");
-				exit(1);
-			}
+	if (fwpool_run(jobs, image.part_count, extract_part, & ex))
+		return -1;
 
-			extracted_file = fopen(extracted_file_name, "w+");
-			if (! extracted_file) {
-				fprintf(stderr, "Cannot open output file %s\n",
-					extracted_file_name);
-				free(extracted_file_name);
-				exit(1);
-			}
+	if (mode == MODE_DUMP) {
+		printf("Version : %u\n", image.version);
+		printf("HWID    : 0x%x\n", image.hwid);
+		printf("Flags   : 0x%x\n", image.flags);
+		if (image.align)
+			printf("Align   : %u\n", image.align);
 
-			if (fwrite(addr + offset, sz, 1, extracted_file) != 1) {
-				fprintf(stderr, "Cannot write output file %s\n",
-					extracted_file_name);
-				free(extracted_file_name);
-				exit(1);
-			}
+		for (i = 0; i < image.part_count; i++) {
+			struct fwimage_part *part = & image.parts[i];
+
+			if (! ex.selected[i])
+				continue;
 
-			fclose(extracted_file);
-			free(extracted_file_name);
+			printf("part[%d] : name=%s, size=%llu, offset=%llu\n",
+			       i, part->name, (unsigned long long) part->length,
+			       (unsigned long long) part->offset);
 		}
 	}
 
+	free(ex.selected);
+	fwimage_release(& image);
+	close(fd);
+
 	return 0;
 }
 
 void help(void)
 {
 	printf("fwupgrade-tool, create and dump firmware images\n");
-	printf(" image creation: fwupgrade-tool -o output-file -p part1name:part1file -p part2name:part2file -i HWID\n");
-	printf(" image dump    : fwupgrade-tool -d image-file\n");
-	printf(" image extract : fwupgrade-tool -x image-file\n");
+	printf(" image creation: fwupgrade-tool -o output-file -p part1name:part1file -p part2name:part2file -i HWID [-V version] [-a align] [-j jobs] [-C cache-file]\n");
+	printf(" image dump    : fwupgrade-tool -d image-file [-n partname] [-N]\n");
+	printf(" image extract : fwupgrade-tool -x image-file [-n partname] [-O output-dir] [-N]\n");
+	printf(" part update   : fwupgrade-tool -u image-file -p partname:partfile|-r partname\n");
+	printf(" batch creation: fwupgrade-tool -m manifest-file [-V version] [-a align] [-j jobs] [-C cache-file]\n");
+	printf(" image diff    : fwupgrade-tool -c old-image-file new-image-file [-b erase-block-size] [-E erase-ms] [-W program-KB/s]\n");
+	printf("\n");
+	printf("A version 1 image is created when the parts allow it (at most %d\n", FWPART_COUNT);
+	printf("parts, all smaller than 4 GB), a version 2 image otherwise. Use\n");
+	printf("-V to force the version.\n");
+	printf("\n");
+	printf("With -a, the data of each part starts at a multiple of align\n");
+	printf("bytes, a power of two such as the flash erase block size, or\n");
+	printf("'page' for the page size.\n");
+	printf("\n");
+	printf("Parts are hashed and copied by -j threads, one per CPU by default.\n");
+	printf("\n");
+	printf("-n selects the parts to dump or extract, and can be repeated. -N\n");
+	printf("skips the MD5 verification of the parts, so that dumping only\n");
+	printf("reads the header. Extracted parts are written to output-dir, the\n");
+	printf("current directory by default, as extracted-<partname>.img.\n");
+	printf("\n");
+	printf("With -o -, the image is written to the standard output, which\n");
+	printf("does not need to be seekable. The parts are read twice, so they\n");
+	printf("must not change while the image is created.\n");
+	printf("\n");
+	printf("With -C, the digests of the parts are kept in cache-file and only\n");
+	printf("the parts whose path, inode, size or modification time changed\n");
+	printf("are hashed again.\n");
+	printf("\n");
+	printf("With -u, the image is modified in place: -p replaces or adds one\n");
+	printf("part, -r removes one. Only the new part is hashed, and the other\n");
+	printf("parts are only moved when their offset changes.\n");
+	printf("\n");
+	printf("A manifest describes one image per line, as 'output-file HWID\n");
+	printf("part1name:part1file ...'. Each distinct part file is hashed once\n");
+	printf("for all the images, which are then written in parallel.\n");
+	printf("\n");
+	printf("-c compares the parts of two images erase block by erase block\n");
+	printf("(128 KB by default) and estimates the flash time from the time\n");
+	printf("to erase a block (2 ms by default) and the program rate (8192\n");
+	printf("KB/s by default).\n");
 }
 
 int main(int argc, char *argv[])
 {
 	int opt;
 	unsigned int hwid = 0;
+	unsigned int version = 0;
+	unsigned int align = 0;
 
 	/* Contains the name:filename list of strings, as passed by
 	   the user using the -p option */
-	char *parts[FWPART_COUNT];
+	char **parts = NULL;
 
-	/* Contains the memory addresses at which each part has been
-	   mapped */
-	void *parts_addrs[FWPART_COUNT];
 	int part_count = 0;
-	int i, ret;
+	int ret;
 
 	char *output = NULL;
 	char *dumpfile = NULL;
 	char *extractfile = NULL;
-	struct fwheader header;
-	unsigned int current_offset = sizeof(struct fwheader);
+	char *cachefile = NULL;
+	char *repackfile = NULL;
+	char *removename = NULL;
+	char *outdir = NULL;
+	char **names = NULL;
+	unsigned int name_count = 0;
+	int verify = 1;
+	struct fwimage image;
+	struct build build;
+	unsigned int jobs = fwpool_default_threads();
+	char *manifest = NULL;
+	char *difffile = NULL;
+	unsigned int block_size = 128 * 1024;
+	double erase_ms = 2, program_kbps = 8192;
 	int verbose = 0;
 
-	memset(parts, 0, sizeof(parts));
-	memset(parts_addrs, 0, sizeof(parts_addrs));
-
 	/* Analyze the options. We fill the "hwid" variable and the
 	   "parts" array. */
-	while ((opt = getopt(argc, argv, "hi:p:o:d:x:v")) != -1) {
+	while ((opt = getopt(argc, argv, "hi:p:o:d:x:vV:a:j:C:u:r:n:O:Nm:c:b:E:W:")) != -1) {
 		switch(opt) {
 		case 'h':
 			help();
@@ -149,8 +1499,9 @@ int main(int argc, char *argv[])
 			break;
 
 		case 'p':
-			if (part_count >= FWPART_COUNT) {
-				fprintf(stderr, "Too many parts\n");
+			parts = realloc(parts, (part_count + 1) * sizeof(char *));
+			if (! parts) {
+				fprintf(stderr, "Cannot allocate memory\n");
 				exit(1);
 			}
 			parts[part_count] = strdup(optarg);
@@ -168,6 +1519,74 @@ int main(int argc, char *argv[])
 		case 'v':
 			verbose = 1;
 			break;
+		case 'V':
+			version = strtol(optarg, NULL, 10);
+			if (version != 1 && version != 2) {
+				fprintf(stderr, "Unsupported image version %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'a':
+			if (! strcmp(optarg, "page"))
+				align = sysconf(_SC_PAGESIZE);
+			else
+				align = strtoul(optarg, NULL, 0);
+			if (align == 0 || (align & (align - 1))) {
+				fprintf(stderr, "Alignment must be a power of two\n");
+				exit(1);
+			}
+			break;
+		case 'c':
+			difffile = strdup(optarg);
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			if (! block_size) {
+				fprintf(stderr, "Invalid erase block size %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'E':
+			erase_ms = strtod(optarg, NULL);
+			break;
+		case 'W':
+			program_kbps = strtod(optarg, NULL);
+			if (program_kbps <= 0) {
+				fprintf(stderr, "Invalid program rate %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'm':
+			manifest = strdup(optarg);
+			break;
+		case 'n':
+			names = realloc(names, (name_count + 1) * sizeof(char *));
+			if (! names) {
+				fprintf(stderr, "Cannot allocate memory\n");
+				exit(1);
+			}
+			names[name_count++] = strdup(optarg);
+			break;
+		case 'O':
+			outdir = strdup(optarg);
+			break;
+		case 'N':
+			verify = 0;
+			break;
+		case 'u':
+			repackfile = strdup(optarg);
+			break;
+		case 'r':
+			removename = strdup(optarg);
+			break;
+		case 'C':
+			cachefile = strdup(optarg);
+			break;
+		case 'j':
+			jobs = strtoul(optarg, NULL, 10);
+			if (jobs == 0)
+				jobs = 1;
+			break;
 		default:
 			fprintf(stderr, "Unknown option\n");
 			exit(1);
@@ -181,11 +1600,69 @@ int main(int argc, char *argv[])
 	}
 
 	if (dumpfile) {
-		return dump_or_extract_file(dumpfile, MODE_DUMP);
+		return dump_or_extract_file(dumpfile, MODE_DUMP, names, name_count,
+					    NULL, verify, jobs) ? 1 : 0;
 	}
 
 	if (extractfile) {
-		return dump_or_extract_file(extractfile, MODE_EXTRACT);
+		return dump_or_extract_file(extractfile, MODE_EXTRACT, names,
+					    name_count, outdir, verify, jobs) ? 1 : 0;
+	}
+
+	if (difffile) {
+		if (optind != argc - 1) {
+			fprintf(stderr, "Option -c takes the old and the new image\n");
+			help();
+			exit(1);
+		}
+
+		return diff_images(difffile, argv[optind], block_size, erase_ms,
+				   program_kbps, jobs) ? 1 : 0;
+	}
+
+	if (manifest) {
+		struct fwcache *cache = NULL;
+
+		if (cachefile) {
+			cache = fwcache_load(cachefile);
+			if (! cache) {
+				fprintf(stderr, "Cannot allocate memory\n");
+				exit(1);
+			}
+		}
+
+		ret = build_batch(manifest, version, align, jobs, cache, verbose);
+
+		if (cache && fwcache_save(cache))
+			fprintf(stderr, "Cannot write digest cache %s: %m\n", cachefile);
+
+		return ret ? 1 : 0;
+	}
+
+	if (repackfile) {
+		struct fwcache *cache = NULL;
+
+		if (part_count + (removename ? 1 : 0) != 1) {
+			fprintf(stderr, "Option -u takes exactly one -p or -r\n");
+			help();
+			exit(1);
+		}
+
+		if (cachefile) {
+			cache = fwcache_load(cachefile);
+			if (! cache) {
+				fprintf(stderr, "Cannot allocate memory\n");
+				exit(1);
+			}
+		}
+
+		ret = repack_image(repackfile, part_count ? parts[0] : NULL,
+				   removename, version, align, cache);
+
+		if (cache && fwcache_save(cache))
+			fprintf(stderr, "Cannot write digest cache %s: %m\n", cachefile);
+
+		return ret ? 1 : 0;
 	}
 
 	if (part_count == 0) {
@@ -206,95 +1683,41 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	memset(& header, 0, sizeof(struct fwheader));
-
-	header.magic = htole32(FWUPGRADE_MAGIC);
-	header.hwid  = htole32(hwid);
-	header.flags = htole32(0);
-
-	/* For each part, we get the part size, map the part into
-	   memory, calculate its MD5 checksum and we fill the header
-	   with those informations. */
-
-	for (i = 0; i < part_count; i++) {
-		struct stat s;
-		int fd;
-		char *filename, *tmp;
-		int name_len;
-
-		/* First, we extract the name:filename informations */
-		tmp = strchr(parts[i], ':');
-		if (! tmp) {
-			fprintf(stderr, "Incorrect part syntax: '%s'\n",
-				parts[i]);
-			exit (1);
-		}
-
-		name_len = tmp - parts[i];
-
-		if (name_len + 1 > FWPART_NAME_SZ) {
-			fprintf(stderr, "Name too long in part: '%s'\n",
-				parts[i]);
+	build.cache = NULL;
+	if (cachefile) {
+		build.cache = fwcache_load(cachefile);
+		if (! build.cache) {
+			fprintf(stderr, "Cannot allocate memory\n");
 			exit(1);
 		}
+	}
 
-		/* Fill the name information of the part header */
-		strncpy(header.parts[i].name, parts[i], name_len);
-		header.parts[i].name[name_len] = '\0';
-
-		/* Skip the ':' to get the filename */
-		filename = tmp + 1;
-
-		/* Get the file size */
-		ret = stat(filename, & s);
-		if (ret) {
-			fprintf(stderr, "Cannot find part '%s'\n", parts[i]);
-			exit(1);
-		}
+	if (setup_image(& image, & build, parts, part_count, hwid, version,
+			align))
+		exit(1);
 
-		/* Store the size in the header */
-		header.parts[i].length = htole32(s.st_size);
-		header.parts[i].offset = htole32(current_offset);
-		current_offset += s.st_size;
+	/* Calculate the MD5 checksum of each part */
+	if (fwpool_run(jobs, part_count, hash_part, & build))
+		exit(1);
 
-		/* Open and map the file */
-		fd = open(filename, O_RDONLY);
-		if (fd < 0) {
-			fprintf(stderr, "Cannot open part '%s'\n", parts[i]);
-			exit(1);
-		}
+	if (build.cache && fwcache_save(build.cache))
+		fprintf(stderr, "Cannot write digest cache %s: %m\n", cachefile);
 
-		parts_addrs[i] = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-		if (parts_addrs[i] == MAP_FAILED) {
-			fprintf(stderr, "Cannot map part '%s'\n", parts[i]);
-			exit(1);
-		}
+	/* Keep stdout for the image when streaming it */
+	if (verbose)
+		print_parts(strcmp(output, "-") ? stdout : stderr, & build);
 
-		/* Compute its MD5 */
-		md5(parts_addrs[i], header.parts[i].length,
-		    header.parts[i].crc);
+	if (! strcmp(output, "-"))
+		return stream_image(& build, STDOUT_FILENO) ? 1 : 0;
 
-		if (verbose)
-			printf("part[%d], name=%s, filename=%s, size=%d, offset=%d, md5=%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx%hhx\n",
-			       i, header.parts[i].name, filename, header.parts[i].length, header.parts[i].offset,
-			       header.parts[i].crc[0], header.parts[i].crc[1],
-			       header.parts[i].crc[2], header.parts[i].crc[3],
-			       header.parts[i].crc[4], header.parts[i].crc[5],
-			       header.parts[i].crc[6], header.parts[i].crc[7],
-			       header.parts[i].crc[8], header.parts[i].crc[9],
-			       header.parts[i].crc[10], header.parts[i].crc[11],
-			       header.parts[i].crc[12], header.parts[i].crc[13],
-			       header.parts[i].crc[14], header.parts[i].crc[15]);
-	}
+	if (open_output(& build, output) ||
+	    fwpool_run(jobs, build.chunk_count, copy_chunk, & build))
+		exit(1);
 
-	/* Write data to the output file: first the header, then each
-	   part */
-	FILE *outfile = fopen(output, "w+");
-	fwrite(& header, 1, sizeof(header), outfile);
-	for (i = 0; i < part_count; i++) {
-		fwrite(parts_addrs[i], 1, header.parts[i].length, outfile);
+	if (close(build.outfd)) {
+		fprintf(stderr, "Cannot write output file %s: %m\n", output);
+		exit(1);
 	}
-	fclose(outfile);
 
 	return 0;
 }
@@ -0,0 +1,99 @@
+#define _GNU_SOURCE /* for basename */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fwupgrade-uboot-env.h"
+
+/*
+ * fw_printenv and fw_setenv front-ends to the U-Boot environment code
+ * of fwupgrade. fw_setenv is a symbolic link to fw_printenv, the
+ * behaviour depends on the executable name.
+ */
+
+static void help(const char *execname)
+{
+	printf("%s, read and modify the U-Boot environment\n", execname);
+	printf(" print variables: fw_printenv [-c config] [-n] [name ...]\n");
+	printf(" set a variable : fw_setenv [-c config] name [value ...]\n");
+	printf(" batch update   : fw_setenv [-c config] -s script-file|-\n");
+	printf("\n");
+	printf("A script has one 'name value' pair per line, a name alone\n");
+	printf("deletes the variable. All the changes of a script are applied\n");
+	printf("with a single read and write of the environment.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char *execname = basename(argv[0]);
+	char *script = NULL;
+	int setenv, n_flag = 0;
+	int opt;
+
+	if (! strcmp(execname, "fw_printenv"))
+		setenv = 0;
+	else if (! strcmp(execname, "fw_setenv"))
+		setenv = 1;
+	else {
+		fprintf(stderr, "Unknown executable name %s\n", execname);
+		return 1;
+	}
+
+	/* Stop at the first non-option, so that values starting with
+	   '-' are left alone */
+	while ((opt = getopt(argc, argv, "+hc:ns:")) != -1) {
+		switch(opt) {
+		case 'h':
+			help(execname);
+			return 0;
+		case 'c':
+			fw_env_set_config(optarg);
+			break;
+		case 'n':
+			if (setenv) {
+				fprintf(stderr, "Option -n is only supported by fw_printenv\n");
+				return 1;
+			}
+			n_flag = 1;
+			break;
+		case 's':
+			if (! setenv) {
+				fprintf(stderr, "Option -s is only supported by fw_setenv\n");
+				return 1;
+			}
+			script = optarg;
+			break;
+		default:
+			help(execname);
+			return 1;
+		}
+	}
+
+	/* The environment code expects argv[0] to be the command name,
+	   followed by '-n' if given */
+	if (n_flag)
+		argv[--optind] = "-n";
+	argv[optind - 1] = execname;
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (! setenv)
+		return fw_printenv(argc, argv) ? 1 : 0;
+
+	if (script) {
+		if (argc > 1) {
+			fprintf(stderr, "Option -s does not take variables\n");
+			return 1;
+		}
+		return fw_parse_script(script) ? 1 : 0;
+	}
+
+	if (argc < 2) {
+		help(execname);
+		return 1;
+	}
+
+	return fw_setenv(argc, argv) ? 1 : 0;
+}
@@ -35,6 +35,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #ifdef MTD_OLD
 # include <linux/mtd/mtd.h>
@@ -42,8 +43,10 @@
 # define  __user	/* nothing */
 # include <mtd/mtd-user.h>
 #endif
+#include <mtd/ubi-user.h>
 
 #include "fwupgrade-uboot-env.h"
+#include "fwupgrade-flash.h"
 
 #define WHITESPACE(c) ((c == '\t') || (c == ' '))
 
@@ -60,6 +63,17 @@ struct envdev_s {
 	ulong erase_size;		/* device erase size */
 	ulong env_sectors;		/* number of environment sectors */
 	uint8_t mtd_type;		/* type of the MTD device */
+	uint8_t backend;		/* how the device is accessed */
+};
+
+/*
+ * Storage backends. MTD devices go through the erase/program cycle,
+ * the others are simply read and written with pread()/pwrite().
+ */
+enum env_backend {
+	ENV_BACKEND_MTD,		/* MTD character device */
+	ENV_BACKEND_FILE,		/* regular file or block device */
+	ENV_BACKEND_UBI,		/* UBI volume, replaced on write */
 };
 
 static struct envdev_s envdevices[2] =
@@ -78,6 +92,7 @@ static int dev_current;
 #define DEVESIZE(i)   envdevices[(i)].erase_size
 #define ENVSECTORS(i) envdevices[(i)].env_sectors
 #define DEVTYPE(i)    envdevices[(i)].mtd_type
+#define DEVBACKEND(i) envdevices[(i)].backend
 
 #define CONFIG_ENV_SIZE ENVSIZE(dev_current)
 
@@ -106,8 +121,21 @@ struct environment {
 	unsigned char		*flags;
 	char			*data;
 	enum flag_scheme	flag_scheme;
+	size_t			dirty_start;	/* first modified data byte */
+	size_t			dirty_end;	/* last modified data byte + 1,
+						   0 if nothing changed */
+	uint32_t		*block_crc;	/* CRC32 of each ENV_CRC_BLOCK
+						   bytes of data */
 };
 
+/*
+ * The CRC of the data is kept as the CRCs of blocks of this size, so
+ * that only the blocks touched by fw_env_write() are read again when
+ * the CRC is updated.
+ */
+#define ENV_CRC_BLOCK	4096
+#define ENV_CRC_BLOCKS	((ENV_SIZE + ENV_CRC_BLOCK - 1) / ENV_CRC_BLOCK)
+
 static struct environment environment = {
 	.flag_scheme = FLAG_NONE,
 };
@@ -210,19 +238,106 @@ static char default_environment[] = {
 static int flash_io (int mode);
 static char *envmatch (char * s1, char * s2);
 static int parse_config (void);
+static int config_parsed;
 
 #if defined(CONFIG_FILE)
 static int get_config (char *);
+static char *config_file = CONFIG_FILE;
+
+/*
+ * Use another configuration file than CONFIG_FILE
+ */
+void fw_env_set_config (char *fname)
+{
+	config_file = fname;
+	config_parsed = 0;
+}
 #endif
+
+/*
+ * Parse the configuration ahead of fw_env_open(), so that a process
+ * that forks for each upgrade only does it once
+ */
+int fw_env_load_config (void)
+{
+	return parse_config ();
+}
 static inline ulong getenvsize (void)
 {
-	ulong rc = CONFIG_ENV_SIZE - sizeof (long);
+	ulong rc = CONFIG_ENV_SIZE - sizeof (uint32_t);
 
 	if (HaveRedundEnv)
 		rc -= sizeof (char);
 	return rc;
 }
 
+/*
+ * Record that the data bytes in [start, end) have been modified since
+ * the environment was read from flash. A single range is kept, grown
+ * to cover every modification.
+ */
+static void env_mark_dirty (char *start, char *end)
+{
+	size_t s = start - environment.data;
+	size_t e = end - environment.data;
+
+	if (!environment.dirty_end) {
+		environment.dirty_start = s;
+		environment.dirty_end   = e;
+		return;
+	}
+
+	if (s < environment.dirty_start)
+		environment.dirty_start = s;
+	if (e > environment.dirty_end)
+		environment.dirty_end = e;
+}
+
+/*
+ * Compute the CRC32 of the data blocks first to last, both included,
+ * into block_crc[]
+ */
+static void env_crc_blocks (char *data, uint32_t *block_crc,
+			    size_t first, size_t last)
+{
+	size_t i;
+
+	for (i = first; i <= last; i++)
+		block_crc[i] = fw_crc32 (0, (uint8_t *) data + i * ENV_CRC_BLOCK,
+				      min ((size_t) ENV_CRC_BLOCK,
+					   ENV_SIZE - i * ENV_CRC_BLOCK));
+}
+
+/*
+ * Combine the CRC32 of each data block into the CRC32 of the whole
+ * data area
+ */
+static uint32_t env_crc_fold (uint32_t *block_crc)
+{
+	size_t i, last = ENV_CRC_BLOCKS - 1;
+	uint32_t op, crc = block_crc[0];
+
+	op = fw_crc32_combine_gen (ENV_CRC_BLOCK);
+	for (i = 1; i < last; i++)
+		crc = fw_crc32_combine_op (crc, block_crc[i], op);
+
+	if (last)
+		crc = fw_crc32_combine (crc, block_crc[last],
+				     ENV_SIZE - last * ENV_CRC_BLOCK);
+
+	return crc;
+}
+
+/*
+ * CRC32 of the whole data area, leaving the CRC of each block in
+ * environment.block_crc for fw_env_close()
+ */
+static uint32_t env_crc (char *data)
+{
+	env_crc_blocks (data, environment.block_crc, 0, ENV_CRC_BLOCKS - 1);
+	return env_crc_fold (environment.block_crc);
+}
+
 static char *fw_string_blank(char *s, int noblank)
 {
 	int i;
@@ -349,10 +464,17 @@ int fw_printenv (int argc, char *argv[])
 
 int fw_env_close(void)
 {
+	/* Nothing was modified, leave the flash alone */
+	if (!environment.dirty_end)
+		return 0;
+
 	/*
-	 * Update CRC
+	 * Update CRC, only going through the modified blocks again
 	 */
-	*environment.crc = crc32(0, (uint8_t *) environment.data, ENV_SIZE);
+	env_crc_blocks (environment.data, environment.block_crc,
+			environment.dirty_start / ENV_CRC_BLOCK,
+			(environment.dirty_end - 1) / ENV_CRC_BLOCK);
+	*environment.crc = env_crc_fold (environment.block_crc);
 
 	/* write environment back to flash */
 	if (flash_io(O_RDWR)) {
@@ -361,6 +483,9 @@ int fw_env_close(void)
 			return -1;
 	}
 
+	environment.dirty_start = 0;
+	environment.dirty_end   = 0;
+
 	return 0;
 }
 
@@ -373,7 +498,7 @@ int fw_env_close(void)
 int fw_env_write(char *name, char *value)
 {
 	int len;
-	char *env, *nxt;
+	char *env, *nxt, *start;
 	char *oldval = NULL;
 
 	/*
@@ -406,6 +531,12 @@ int fw_env_write(char *name, char *value)
 			return -1;
 		}
 
+		/* Same value, nothing to do */
+		if (value && *value && !strcmp (oldval, value))
+			return 0;
+
+		start = env;
+
 		if (*++nxt == '\0') {
 			*env = '\0';
 		} else {
@@ -417,6 +548,7 @@ int fw_env_write(char *name, char *value)
 			}
 		}
 		*++env = '\0';
+		env_mark_dirty (start, env + 1);
 	}
 
 	/* Delete only ? */
@@ -444,6 +576,7 @@ int fw_env_write(char *name, char *value)
 		return -1;
 	}
 
+	start = env;
 	while ((*env = *name++) != '\0')
 		env++;
 	*env = '=';
@@ -452,6 +585,7 @@ int fw_env_write(char *name, char *value)
 
 	/* end is marked with double '\0' */
 	*++env = '\0';
+	env_mark_dirty (start, env + 1);
 
 	return 0;
 }
@@ -638,16 +772,16 @@ int fw_parse_script(char *fname)
  * 0	- block is good
  * > 0	- block is bad
  * < 0	- failed to test
+ *
+ * The bad block map is cached per device, see fwupgrade-flash.c
  */
 static int flash_bad_block (int fd, uint8_t mtd_type, loff_t *blockstart)
 {
 	if (mtd_type == MTD_NANDFLASH) {
-		int badblock = ioctl (fd, MEMGETBADBLOCK, blockstart);
+		int badblock = flash_block_isbad (fd, *blockstart);
 
-		if (badblock < 0) {
-			perror ("Cannot read bad block mark");
+		if (badblock < 0)
 			return badblock;
-		}
 
 		if (badblock) {
 #ifdef DEBUG
@@ -835,7 +969,11 @@ static int flash_write_buf (int dev, int fd, void *buf, size_t count,
 		 */
 		erasesize = blocklen;
 	} else {
-		erasesize = erase_len;
+		/*
+		 * NOR: only erase the sectors covering the data, the
+		 * rest of the area is left untouched.
+		 */
+		erasesize = write_total;
 	}
 
 	erase.length = erasesize;
@@ -865,7 +1003,15 @@ static int flash_write_buf (int dev, int fd, void *buf, size_t count,
 				fprintf (stderr, "MTD erase error on %s: %s\n",
 					 DEVNAME (dev),
 					 strerror (errno));
-				return -1;
+				if (mtd_type != MTD_NANDFLASH)
+					return -1;
+				/*
+				 * NAND: mark the block bad and retry in
+				 * the next one, readers skip it as well
+				 */
+				flash_block_markbad (fd, blockstart);
+				blockstart += blocklen;
+				continue;
 			}
 
 		if (lseek (fd, blockstart, SEEK_SET) == -1) {
@@ -886,9 +1032,9 @@ static int flash_write_buf (int dev, int fd, void *buf, size_t count,
 
 		ioctl (fd, MEMLOCK, &erase);
 
-		processed  += blocklen;
+		processed  += erasesize;
 		block_seek = 0;
-		blockstart += blocklen;
+		blockstart += erasesize;
 	}
 
 	if (write_total > count)
@@ -923,9 +1069,62 @@ static int flash_flag_obsolete (int dev, int fd, off_t offset)
 	return rc;
 }
 
+/*
+ * Write the environment to a file, a block device or a UBI volume. No
+ * erase cycle is needed: a file is updated in place, and when it is the
+ * copy we read from, only the header and the modified bytes are
+ * written. A UBI volume can only be replaced as a whole, with a volume
+ * update.
+ */
+static int file_write_buf (int dev, int fd, int in_place)
+{
+	size_t hdrlen = environment.data - (char *) environment.image;
+	int64_t bytes = ENVSIZE (dev);
+	ssize_t rc;
+
+	if (DEVBACKEND (dev) == ENV_BACKEND_UBI) {
+		if (ioctl (fd, UBI_IOCVOLUP, &bytes) < 0) {
+			fprintf (stderr, "Cannot start volume update on %s: %s\n",
+				 DEVNAME (dev), strerror (errno));
+			return -1;
+		}
+		rc = write (fd, environment.image, ENVSIZE (dev));
+	} else if (in_place) {
+		rc = pwrite (fd, environment.image, hdrlen, DEVOFFSET (dev));
+		if (rc == hdrlen) {
+			size_t len = environment.dirty_end -
+				environment.dirty_start;
+
+			rc = pwrite (fd,
+				     environment.data + environment.dirty_start,
+				     len, DEVOFFSET (dev) + hdrlen +
+				     environment.dirty_start);
+			rc = (rc == len) ? ENVSIZE (dev) : -1;
+		}
+	} else {
+		rc = pwrite (fd, environment.image, ENVSIZE (dev),
+			     DEVOFFSET (dev));
+	}
+
+	if (rc != ENVSIZE (dev)) {
+		fprintf (stderr, "Write error on %s: %s\n",
+			 DEVNAME (dev), strerror (errno));
+		return -1;
+	}
+
+	if (fsync (fd)) {
+		fprintf (stderr, "Cannot sync %s: %s\n",
+			 DEVNAME (dev), strerror (errno));
+		return -1;
+	}
+
+	return rc;
+}
+
 static int flash_write (int fd_current, int fd_target, int dev_target)
 {
 	int rc;
+	size_t count = CONFIG_ENV_SIZE;
 
 	switch (environment.flag_scheme) {
 	case FLAG_NONE:
@@ -946,9 +1145,22 @@ static int flash_write (int fd_current, int fd_target, int dev_target)
 	printf ("Writing new environment at 0x%lx on %s\n",
 		DEVOFFSET (dev_target), DEVNAME (dev_target));
 #endif
-	rc = flash_write_buf (dev_target, fd_target, environment.image,
-			      CONFIG_ENV_SIZE, DEVOFFSET (dev_target),
-			      DEVTYPE(dev_target));
+	/*
+	 * When rewriting the copy we read from, the sectors after the
+	 * last modified byte already hold the right data. The redundant
+	 * copy is stale and has to be written completely.
+	 */
+	if (dev_target == dev_current)
+		count = (environment.data - (char *) environment.image) +
+			environment.dirty_end;
+
+	if (DEVBACKEND (dev_target) == ENV_BACKEND_MTD)
+		rc = flash_write_buf (dev_target, fd_target, environment.image,
+				      count, DEVOFFSET (dev_target),
+				      DEVTYPE(dev_target));
+	else
+		rc = file_write_buf (dev_target, fd_target,
+				     dev_target == dev_current);
 	if (rc < 0)
 		return rc;
 
@@ -966,11 +1178,25 @@ static int flash_write (int fd_current, int fd_target, int dev_target)
 	return 0;
 }
 
-static int flash_read (int fd)
+static int flash_read (int dev, int fd, void *image)
 {
 	struct mtd_info_user mtdinfo;
 	int rc;
 
+	if (DEVBACKEND (dev) != ENV_BACKEND_MTD) {
+		DEVTYPE(dev) = MTD_ABSENT;
+
+		rc = pread (fd, image, ENVSIZE (dev), DEVOFFSET (dev));
+		if (rc != ENVSIZE (dev)) {
+			fprintf (stderr, "Read error on %s: %s\n",
+				 DEVNAME (dev),
+				 rc < 0 ? strerror (errno) : "short read");
+			return -1;
+		}
+
+		return 0;
+	}
+
 	rc = ioctl (fd, MEMGETINFO, &mtdinfo);
 	if (rc < 0) {
 		perror ("Cannot get MTD information");
@@ -984,17 +1210,92 @@ static int flash_read (int fd)
 		return -1;
 	}
 
-	DEVTYPE(dev_current) = mtdinfo.type;
+	DEVTYPE(dev) = mtdinfo.type;
+
+	rc = flash_read_buf (dev, fd, image, ENVSIZE (dev),
+			     DEVOFFSET (dev), mtdinfo.type);
+
+	return (rc != ENVSIZE (dev)) ? -1 : 0;
+}
+
+/*
+ * Read one copy of the environment into image. Only touches the
+ * envdevices[] entry of dev, so that both copies can be read at the
+ * same time.
+ */
+struct env_copy {
+	int	dev;
+	void	*image;
+	int	rc;
+};
+
+static void *flash_read_copy (void *arg)
+{
+	struct env_copy *copy = arg;
+	int fd;
+
+	fd = open (DEVNAME (copy->dev), O_RDONLY);
+	if (fd < 0) {
+		fprintf (stderr,
+			 "Can't open %s: %s\n",
+			 DEVNAME (copy->dev), strerror (errno));
+		copy->rc = -1;
+		return NULL;
+	}
+
+	copy->rc = flash_read (copy->dev, fd, copy->image);
+
+	if (close (fd)) {
+		fprintf (stderr,
+			 "I/O error on %s: %s\n",
+			 DEVNAME (copy->dev), strerror (errno));
+		copy->rc = -1;
+	}
+
+	return NULL;
+}
+
+/*
+ * eMMC boot partitions are read-only unless force_ro is cleared in
+ * sysfs. Set force_ro of dev to value, returning the previous value,
+ * or 0 if dev is not an eMMC boot partition.
+ */
+static char env_force_ro (int dev, char value)
+{
+	char path[128];
+	char *name;
+	char old;
+	int fd;
 
-	rc = flash_read_buf (dev_current, fd, environment.image, CONFIG_ENV_SIZE,
-			     DEVOFFSET (dev_current), mtdinfo.type);
+	name = strrchr (DEVNAME (dev), '/');
+	name = name ? name + 1 : DEVNAME (dev);
+	if (strncmp (name, "mmcblk", 6) || !strstr (name, "boot"))
+		return 0;
+
+	snprintf (path, sizeof (path), "/sys/class/block/%s/force_ro", name);
+	fd = open (path, O_RDWR);
+	if (fd < 0)
+		return 0;
+
+	if (read (fd, &old, 1) != 1)
+		old = 0;
+	else if (old != value &&
+		 pwrite (fd, &value, 1, 0) != 1)
+		fprintf (stderr, "Cannot set %s to %c: %s\n",
+			 path, value, strerror (errno));
 
-	return (rc != CONFIG_ENV_SIZE) ? -1 : 0;
+	close (fd);
+	return old;
 }
 
 static int flash_io (int mode)
 {
-	int fd_current, fd_target, rc, dev_target;
+	int fd_current, fd_target, rc, dev_target, i;
+	char force_ro[2] = { 0, 0 };
+
+	if (mode == O_RDWR)
+		for (i = 0; i <= HaveRedundEnv; i++)
+			force_ro[i] = env_force_ro (i, '0');
 
 	/* dev_current: fd_current, erase_current */
 	fd_current = open (DEVNAME (dev_current), mode);
@@ -1002,7 +1303,8 @@ static int flash_io (int mode)
 		fprintf (stderr,
 			 "Can't open %s: %s\n",
 			 DEVNAME (dev_current), strerror (errno));
-		return -1;
+		rc = -1;
+		goto restore;
 	}
 
 	if (mode == O_RDWR) {
@@ -1036,7 +1338,7 @@ static int flash_io (int mode)
 			}
 		}
 	} else {
-		rc = flash_read (fd_current);
+		rc = flash_read (dev_current, fd_current, environment.image);
 	}
 
 exit:
@@ -1044,9 +1346,14 @@ exit:
 		fprintf (stderr,
 			 "I/O error on %s: %s\n",
 			 DEVNAME (dev_current), strerror (errno));
-		return -1;
+		rc = -1;
 	}
 
+restore:
+	for (i = 0; i <= HaveRedundEnv; i++)
+		if (force_ro[i] == '1')
+			env_force_ro (i, '1');
+
 	return rc;
 }
 
@@ -1067,18 +1374,60 @@ static char *envmatch (char * s1, char * s2)
 	return NULL;
 }
 
+/*
+ * Tell which of the two redundant copies is the most recent one
+ * according to their flags, assuming both have a valid CRC.
+ */
+static int env_flag_preferred (unsigned char flag0, unsigned char flag1)
+{
+	switch (environment.flag_scheme) {
+	case FLAG_BOOLEAN:
+		if (flag0 == active_flag &&
+		    flag1 == obsolete_flag) {
+			return 0;
+		} else if (flag0 == obsolete_flag &&
+			   flag1 == active_flag) {
+			return 1;
+		} else if (flag0 == flag1) {
+			return 0;
+		} else if (flag0 == 0xFF) {
+			return 0;
+		} else if (flag1 == 0xFF) {
+			return 1;
+		} else {
+			return 0;
+		}
+	case FLAG_INCREMENTAL:
+		if (flag0 == 255 && flag1 == 0)
+			return 1;
+		else if ((flag1 == 255 && flag0 == 0) ||
+			 flag0 >= flag1)
+			return 0;
+		else /* flag1 > flag0 */
+			return 1;
+	default:
+		fprintf (stderr, "Unknown flag scheme %u \n",
+			 environment.flag_scheme);
+		return -1;
+	}
+}
+
+static int env_copy_valid (struct env_image_redundant *redundant)
+{
+	return env_crc (redundant->data) == redundant->crc;
+}
+
 /*
  * Prevent confusion if running from erased flash memory
  */
 int fw_env_open(void)
 {
-	int crc0, crc0_ok;
-	unsigned char flag0;
-	void *addr0;
-
-	int crc1, crc1_ok;
-	unsigned char flag1;
-	void *addr1;
+	uint32_t crc0;
+	int crc0_ok;
+	void *addr0, *addr1;
+	int preferred, threaded;
+	pthread_t thread;
+	struct env_copy copy0, copy1;
 
 	struct env_image_single *single;
 	struct env_image_redundant *redundant;
@@ -1096,144 +1445,152 @@ int fw_env_open(void)
 
 	/* read environment from FLASH to local buffer */
 	environment.image = addr0;
+	environment.dirty_start = 0;
+	environment.dirty_end   = 0;
 
-	if (HaveRedundEnv) {
-		redundant = addr0;
-		environment.crc		= &redundant->crc;
-		environment.flags	= &redundant->flags;
-		environment.data	= redundant->data;
-	} else {
+	dev_current = 0;
+	free (environment.block_crc);
+	environment.block_crc = calloc (ENV_CRC_BLOCKS, sizeof (uint32_t));
+	if (environment.block_crc == NULL) {
+		fprintf (stderr, "Not enough memory for environment CRC\n");
+		free (addr0);
+		return -1;
+	}
+
+	if (!HaveRedundEnv) {
 		single = addr0;
 		environment.crc		= &single->crc;
 		environment.flags	= NULL;
 		environment.data	= single->data;
-	}
 
-	dev_current = 0;
-	if (flash_io (O_RDONLY))
-		return -1;
+		dev_current = 0;
+		if (flash_io (O_RDONLY))
+			return -1;
 
-	crc0 = crc32 (0, (uint8_t *) environment.data, ENV_SIZE);
-	crc0_ok = (crc0 == *environment.crc);
-	if (!HaveRedundEnv) {
+		crc0 = env_crc (environment.data);
+		crc0_ok = (crc0 == *environment.crc);
 		if (!crc0_ok) {
 			fprintf (stderr,
 				"Warning: Bad CRC, using default environment\n");
 			memcpy(environment.data, default_environment, sizeof default_environment);
+			env_mark_dirty (environment.data,
+					environment.data + ENV_SIZE);
 		}
-	} else {
-		flag0 = *environment.flags;
+		return 0;
+	}
 
-		dev_current = 1;
-		addr1 = calloc (1, CONFIG_ENV_SIZE);
-		if (addr1 == NULL) {
-			fprintf (stderr,
-				"Not enough memory for environment (%ld bytes)\n",
-				CONFIG_ENV_SIZE);
-			return -1;
-		}
-		redundant = addr1;
+	addr1 = calloc (1, ENVSIZE (1));
+	if (addr1 == NULL) {
+		fprintf (stderr,
+			"Not enough memory for environment (%ld bytes)\n",
+			ENVSIZE (1));
+		free (addr0);
+		return -1;
+	}
 
-		/*
-		 * have to set environment.image for flash_read(), careful -
-		 * other pointers in environment still point inside addr0
-		 */
-		environment.image = addr1;
-		if (flash_io (O_RDONLY))
-			return -1;
+	/*
+	 * Read both copies at the same time, copy 1 from a separate
+	 * thread. Fall back to reading them one after the other if the
+	 * thread cannot be created.
+	 */
+	copy0.dev   = 0;
+	copy0.image = addr0;
+	copy1.dev   = 1;
+	copy1.image = addr1;
+
+	threaded = !pthread_create (&thread, NULL, flash_read_copy, &copy1);
+	flash_read_copy (&copy0);
+	if (threaded)
+		pthread_join (thread, NULL);
+	else
+		flash_read_copy (&copy1);
+
+	if (copy0.rc || copy1.rc)
+		goto error;
+
+	/* Check flag scheme compatibility */
+	if (DEVTYPE(0) == MTD_NORFLASH &&
+	    DEVTYPE(1) == MTD_NORFLASH) {
+		environment.flag_scheme = FLAG_BOOLEAN;
+	} else if (DEVTYPE(0) == MTD_NANDFLASH &&
+		   DEVTYPE(1) == MTD_NANDFLASH) {
+		environment.flag_scheme = FLAG_INCREMENTAL;
+	} else if (DEVTYPE(0) == MTD_DATAFLASH &&
+		   DEVTYPE(1) == MTD_DATAFLASH) {
+		environment.flag_scheme = FLAG_BOOLEAN;
+	} else if (DEVTYPE(0) == MTD_ABSENT &&
+		   DEVTYPE(1) == MTD_ABSENT) {
+		environment.flag_scheme = FLAG_INCREMENTAL;
+	} else {
+		fprintf (stderr, "Incompatible flash types!\n");
+		goto error;
+	}
 
-		/* Check flag scheme compatibility */
-		if (DEVTYPE(dev_current) == MTD_NORFLASH &&
-		    DEVTYPE(!dev_current) == MTD_NORFLASH) {
-			environment.flag_scheme = FLAG_BOOLEAN;
-		} else if (DEVTYPE(dev_current) == MTD_NANDFLASH &&
-			   DEVTYPE(!dev_current) == MTD_NANDFLASH) {
-			environment.flag_scheme = FLAG_INCREMENTAL;
-		} else if (DEVTYPE(dev_current) == MTD_DATAFLASH &&
-			   DEVTYPE(!dev_current) == MTD_DATAFLASH) {
-			environment.flag_scheme = FLAG_BOOLEAN;
-		} else {
-			fprintf (stderr, "Incompatible flash types!\n");
-			return -1;
-		}
+	preferred = env_flag_preferred (
+		((struct env_image_redundant *) addr0)->flags,
+		((struct env_image_redundant *) addr1)->flags);
+	if (preferred < 0)
+		goto error;
 
-		crc1 = crc32 (0, (uint8_t *) redundant->data, ENV_SIZE);
-		crc1_ok = (crc1 == redundant->crc);
-		flag1 = redundant->flags;
+	/*
+	 * The copy designated by the flags wins whenever its CRC is
+	 * good, so the CRC of the other copy is only computed when it
+	 * has to replace a corrupted one.
+	 */
+	dev_current = preferred;
+	if (!env_copy_valid (preferred ? addr1 : addr0)) {
+		dev_current = !preferred;
+		if (!env_copy_valid (dev_current ? addr1 : addr0))
+			dev_current = -1;
+	}
 
-		if (crc0_ok && !crc1_ok) {
-			dev_current = 0;
-		} else if (!crc0_ok && crc1_ok) {
-			dev_current = 1;
-		} else if (!crc0_ok && !crc1_ok) {
-			fprintf (stderr,
-				"Warning: Bad CRC, using default environment\n");
-			memcpy (environment.data, default_environment,
-				sizeof default_environment);
-			dev_current = 0;
-		} else {
-			switch (environment.flag_scheme) {
-			case FLAG_BOOLEAN:
-				if (flag0 == active_flag &&
-				    flag1 == obsolete_flag) {
-					dev_current = 0;
-				} else if (flag0 == obsolete_flag &&
-					   flag1 == active_flag) {
-					dev_current = 1;
-				} else if (flag0 == flag1) {
-					dev_current = 0;
-				} else if (flag0 == 0xFF) {
-					dev_current = 0;
-				} else if (flag1 == 0xFF) {
-					dev_current = 1;
-				} else {
-					dev_current = 0;
-				}
-				break;
-			case FLAG_INCREMENTAL:
-				if (flag0 == 255 && flag1 == 0)
-					dev_current = 1;
-				else if ((flag1 == 255 && flag0 == 0) ||
-					 flag0 >= flag1)
-					dev_current = 0;
-				else /* flag1 > flag0 */
-					dev_current = 1;
-				break;
-			default:
-				fprintf (stderr, "Unknown flag scheme %u \n",
-					 environment.flag_scheme);
-				return -1;
-			}
-		}
+	/*
+	 * If we are reading, we don't need the flag and the CRC any
+	 * more, if we are writing, we will re-calculate CRC and update
+	 * flags before writing out
+	 */
+	if (dev_current == 1) {
+		environment.image = addr1;
+		free (addr0);
+	} else {
+		environment.image = addr0;
+		free (addr1);
+	}
 
-		/*
-		 * If we are reading, we don't need the flag and the CRC any
-		 * more, if we are writing, we will re-calculate CRC and update
-		 * flags before writing out
-		 */
-		if (dev_current) {
-			environment.image	= addr1;
-			environment.crc		= &redundant->crc;
-			environment.flags	= &redundant->flags;
-			environment.data	= redundant->data;
-			free (addr0);
-		} else {
-			environment.image	= addr0;
-			/* Other pointers are already set */
-			free (addr1);
-		}
+	redundant = environment.image;
+	environment.crc		= &redundant->crc;
+	environment.flags	= &redundant->flags;
+	environment.data	= redundant->data;
+
+	if (dev_current < 0) {
+		dev_current = 0;
+		fprintf (stderr,
+			"Warning: Bad CRC, using default environment\n");
+		memcpy (environment.data, default_environment,
+			sizeof default_environment);
+		env_mark_dirty (environment.data,
+				environment.data + ENV_SIZE);
 	}
+
 	return 0;
-}
 
+error:
+	free (addr0);
+	free (addr1);
+	return -1;
+}
 
 static int parse_config ()
 {
 	struct stat st;
+	int i;
+
+	if (config_parsed)
+		return 0;
 
 #if defined(CONFIG_FILE)
 	/* Fills in DEVNAME(), ENVSIZE(), DEVESIZE(). Or don't. */
-	if (get_config (CONFIG_FILE)) {
+	if (get_config (config_file)) {
 		fprintf (stderr,
 			"Cannot parse config file: %s\n", strerror (errno));
 		return -1;
@@ -1268,19 +1625,28 @@ static int parse_config ()
 	HaveRedundEnv = 1;
 #endif
 #endif
-	if (stat (DEVNAME (0), &st)) {
-		fprintf (stderr,
-			"Cannot access MTD device %s: %s\n",
-			DEVNAME (0), strerror (errno));
-		return -1;
-	}
+	for (i = 0; i <= HaveRedundEnv; i++) {
+		if (stat (DEVNAME (i), &st)) {
+			fprintf (stderr,
+				"Cannot access environment device %s: %s\n",
+				DEVNAME (i), strerror (errno));
+			return -1;
+		}
 
-	if (HaveRedundEnv && stat (DEVNAME (1), &st)) {
-		fprintf (stderr,
-			"Cannot access MTD device %s: %s\n",
-			DEVNAME (1), strerror (errno));
-		return -1;
+		/*
+		 * Regular files and block devices (e.g. eMMC boot
+		 * partitions) are accessed with pread()/pwrite(), UBI
+		 * volumes are character devices named after UBI.
+		 */
+		if (S_ISREG (st.st_mode) || S_ISBLK (st.st_mode))
+			DEVBACKEND (i) = ENV_BACKEND_FILE;
+		else if (!strncmp (DEVNAME (i), "/dev/ubi", 8))
+			DEVBACKEND (i) = ENV_BACKEND_UBI;
+		else
+			DEVBACKEND (i) = ENV_BACKEND_MTD;
 	}
+
+	config_parsed = 1;
 	return 0;
 }
 
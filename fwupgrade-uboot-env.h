@@ -21,6 +21,8 @@
  * MA 02111-1307 USA
  */
 
+#include <stdint.h>
+
 #define CONFIG_FILE     "/etc/fw_env.config"
 
 extern int   fw_printenv(int argc, char *argv[]);
@@ -31,5 +33,11 @@ extern int fw_env_open(void);
 extern int fw_env_write(char *name, char *value);
 extern char *fw_env_read(char *name);
 extern int fw_env_close(void);
+extern void fw_env_set_config(char *fname);
+extern int fw_env_load_config(void);
 
-extern unsigned	long  crc32	 (unsigned long, const unsigned char *, unsigned);
+/* Prefixed, so as not to clash with zlib when it is linked in */
+extern uint32_t fw_crc32 (uint32_t, const unsigned char *, unsigned);
+extern uint32_t fw_crc32_combine (uint32_t crc1, uint32_t crc2, uint64_t len2);
+extern uint32_t fw_crc32_combine_gen (uint64_t len2);
+extern uint32_t fw_crc32_combine_op (uint32_t crc1, uint32_t crc2, uint32_t op);
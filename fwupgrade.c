@@ -3,18 +3,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <limits.h>
+#include <stdint.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/reboot.h>
 #include <linux/reboot.h>
 
 #include "fwupgrade.h"
 #include "fwupgrade-cgi.h"
+#include "fwupgrade-daemon.h"
 #include "fwupgrade-file.h"
+#include "fwupgrade-flash.h"
+#include "fwupgrade-http.h"
+#include "fwupgrade-image.h"
+#include "fwupgrade-progress.h"
+#include "fwupgrade-session.h"
 #include "fwupgrade-uboot-env.h"
 
 #define THIS_HWID 0x2424
 
+/* Socket of the upgrade daemon, relayed to by fwupgrade-cgi */
+#ifndef FWUPGRADE_SOCKET
+#define FWUPGRADE_SOCKET "/var/run/fwupgrade.sock"
+#endif
+
+/* Held by the process doing an upgrade, in every mode */
+#ifndef FWUPGRADE_LOCK
+#define FWUPGRADE_LOCK "/var/run/fwupgrade.lock"
+#endif
+
 struct fwupgrade_action {
 	const char *part_name;
 	const char *uboot_part1;
@@ -24,50 +48,60 @@ struct fwupgrade_action {
 	enum { TYPE_MTD, TYPE_UBI } type;
 };
 
-struct fwupgrade_action actions[FWPART_COUNT];
+/* Array of action_count actions, grown while parsing the
+   configuration */
+struct fwupgrade_action *actions;
+unsigned int action_count;
 
-int flash_fwpart(const char *part, const char *data, unsigned int len,
-		 int type)
+/* Size of the pieces of a part in memory written at once, so that the
+   progress moves */
+#define FLASH_CHUNK_SZ (1024 * 1024)
+
+/* Write to a partition and account for it in the progress */
+static int progress_write(struct flash_writer *w, const char *data,
+			  size_t len)
 {
-	char cmd[1024];
-	int ret;
-	FILE *flash_pipe;
-	size_t sz;
+	if (flash_writer_write(w, data, len))
+		return -1;
 
-	if (type == TYPE_MTD) {
-		printf("Erasing partition %s\n", part);
+	fwupgrade_progress_add(len);
+	fwupgrade_progress_bad_blocks(flash_writer_bad_blocks(w));
 
-		snprintf(cmd, sizeof(cmd), "flash_erase -q /dev/%s 0 0", part);
-		ret = system(cmd);
-		if (ret) {
-			printf("ERROR: Unable to erase partition %s, aborting.\n", part);
-			return -1;
-		}
+	return 0;
+}
 
-		printf("Flashing partition %s\n", part);
+int flash_fwpart(const char *part, const char *data, size_t len,
+		 int type)
+{
+	struct flash_writer *w;
+	size_t n;
+	int ret = 0;
 
-		snprintf(cmd, sizeof(cmd), "nandwrite -q -p /dev/%s -", part);
-	} else {
-		printf("Flashing partition %s\n", part);
+	printf("Flashing partition %s\n", part);
 
-		snprintf(cmd, sizeof(cmd), "ubiupdatevol /dev/ubi/%s --size=%d -",
-			 part, len);
-	}
+	if (type == TYPE_MTD)
+		w = flash_writer_open_mtd(part);
+	else
+		w = flash_writer_open_ubi(part, len);
 
-	flash_pipe = popen(cmd, "w");
-	if (! flash_pipe) {
+	if (! w) {
 		printf("ERROR: Unable to flash partition %s, aborting\n", part);
 		return -1;
 	}
 
-	sz = fwrite(data, len, 1, flash_pipe);
-	if (sz != 1) {
-		printf("ERROR: Unable to flash partition %s, aborting\n", part);
-		return -1;
+	while (len && ! ret) {
+		n = len < FLASH_CHUNK_SZ ? len : FLASH_CHUNK_SZ;
+		ret = progress_write(w, data, n);
+		data += n;
+		len  -= n;
 	}
 
-	ret = pclose(flash_pipe);
-	if (! WIFEXITED(ret) || WEXITSTATUS(ret) != 0) {
+	/* The rest of the partition is not erased after a failure */
+	if (ret)
+		flash_writer_abort(w);
+	else
+		ret = flash_writer_close(w);
+	if (ret) {
 		printf("ERROR: Unable to flash partition %s, aborting\n", part);
 		return -1;
 	}
@@ -75,23 +109,39 @@ int flash_fwpart(const char *part, const char *data, unsigned int len,
 	return 0;
 }
 
-int handle_fwpart(const char *partname, const char *data, unsigned int len)
+/* The action for a part of the image, or NULL */
+static struct fwupgrade_action *find_action(const char *partname)
 {
-	struct fwupgrade_action *act = NULL;
-	const char *current_part, *next_kernel_part, *next_uboot_part;
-	char uboot_varname[64];
-	int i, ret;
+	int i;
 
-	for (i = 0; i < FWPART_COUNT; i++) {
+	for (i = 0; i < action_count; i++) {
 		if (actions[i].part_name == NULL)
 			break;
 
-		if (! strcmp(actions[i].part_name, partname)) {
-			act = & actions[i];
-			break;
-		}
+		if (! strcmp(actions[i].part_name, partname))
+			return & actions[i];
 	}
 
+	return NULL;
+}
+
+/*
+ * Find the action for a part of the image, and from the U-Boot
+ * environment the partition to flash it to, which is the one not in
+ * use. uboot_varname, of size varname_sz, receives the name of the
+ * variable to update once the part is flashed, and next_uboot_part
+ * its new value.
+ */
+static int prepare_fwpart(const char *partname,
+			  struct fwupgrade_action **act_out,
+			  const char **next_kernel_part,
+			  const char **next_uboot_part,
+			  char *uboot_varname, size_t varname_sz)
+{
+	struct fwupgrade_action *act;
+	const char *current_part;
+
+	act = find_action(partname);
 	if (! act) {
 		printf("ERROR: Unknown partition '%s' in firmware image, aborting.\n", partname);
 		return -1;
@@ -99,11 +149,9 @@ int handle_fwpart(const char *partname, const char *data, unsigned int len)
 
 	/* The u-boot variable is different according to MTD/UBI */
 	if (act->type == TYPE_UBI) {
-		snprintf(uboot_varname, sizeof(uboot_varname), "%s_ubivol",
-			 partname);
+		snprintf(uboot_varname, varname_sz, "%s_ubivol", partname);
 	} else {
-		snprintf(uboot_varname, sizeof(uboot_varname), "%s_mtdpart",
-			 partname);
+		snprintf(uboot_varname, varname_sz, "%s_mtdpart", partname);
 	}
 
 	current_part = fw_env_read(uboot_varname);
@@ -114,12 +162,12 @@ int handle_fwpart(const char *partname, const char *data, unsigned int len)
 	}
 
 	if (! strcmp(current_part, act->uboot_part1)) {
-		next_kernel_part = act->kernel_part2;
-		next_uboot_part = act->uboot_part2;
+		*next_kernel_part = act->kernel_part2;
+		*next_uboot_part = act->uboot_part2;
 	}
 	else if (! strcmp(current_part, act->uboot_part2)) {
-		next_kernel_part = act->kernel_part1;
-		next_uboot_part = act->uboot_part1;
+		*next_kernel_part = act->kernel_part1;
+		*next_uboot_part = act->uboot_part1;
 	}
 	else {
 		printf("ERROR: Invalid current partition '%s' for %s, aborting.\n",
@@ -127,6 +175,25 @@ int handle_fwpart(const char *partname, const char *data, unsigned int len)
 		return -1;
 	}
 
+	*act_out = act;
+	return 0;
+}
+
+int handle_fwpart(const char *partname, const char *data, size_t len)
+{
+	struct fwupgrade_action *act;
+	const char *next_kernel_part, *next_uboot_part;
+	char uboot_varname[64];
+	int ret;
+
+	ret = prepare_fwpart(partname, & act, & next_kernel_part,
+			     & next_uboot_part, uboot_varname,
+			     sizeof(uboot_varname));
+	if (ret)
+		return ret;
+
+	fwupgrade_progress_stage("flash", partname, next_kernel_part, len);
+
 	ret = flash_fwpart(next_kernel_part, data, len, act->type);
 	if (ret)
 		return ret;
@@ -136,66 +203,192 @@ int handle_fwpart(const char *partname, const char *data, unsigned int len)
 	return 0;
 }
 
-int apply_upgrade(const char *data, unsigned int data_length)
+/* Sanity limit on the number of parts of a version 2 image */
+#define MAX_PARTS 1024
+
+/*
+ * Check the header of an image, as soon as it is received: magic,
+ * HWID, and each part against the configured actions and the size of
+ * the partitions it may be flashed to. Only the header has to be in
+ * data. Returns 0 if the image is acceptable, -1 if it is not, or the
+ * number of bytes needed to decide. In CGI mode, the response status
+ * tells the outcome.
+ */
+static int check_image_header(const char *data, size_t len)
 {
-	int i, ret;
-	struct fwheader *header = (struct fwheader *) data;
+	const struct fwheader_v2 *v2 = (const struct fwheader_v2 *) data;
+	struct fwimage image;
+	size_t need;
+	unsigned int i, j;
+	int ret;
+
+	/* The fixed part of the header tells how large the whole
+	   header is */
+	if (len < sizeof(struct fwheader_v2))
+		return sizeof(struct fwheader_v2);
+
+	switch (le32toh(v2->magic)) {
+	case FWUPGRADE_MAGIC:
+		need = sizeof(struct fwheader);
+		break;
+	case FWUPGRADE_MAGIC_V2:
+		if (le32toh(v2->part_count) > MAX_PARTS) {
+			fwupgrade_cgi_status(400);
+			printf("ERROR: Too many parts in firmware image, aborting.\n");
+			return -1;
+		}
+		need = fwimage_header_size(2, le32toh(v2->part_count));
+		break;
+	default:
+		need = 0;
+		break;
+	}
 
-	if (le32toh(header->magic) != FWUPGRADE_MAGIC) {
-		printf("ERROR: Invalid firmware magic, aborting.\n");
+	if (len < need)
+		return need;
+
+	ret = fwimage_parse(data, len, & image);
+	if (ret) {
+		fwupgrade_cgi_status(400);
+		printf("ERROR: %s, aborting.\n", fwimage_strerror(ret));
 		return -1;
 	}
 
-	if (le32toh(header->hwid) != THIS_HWID) {
+	if (image.hwid != THIS_HWID) {
+		fwupgrade_cgi_status(400);
 		printf("ERROR: Invalid HWID, aborting.\n");
+		goto error;
+	}
+
+	for (i = 0; i < image.part_count; i++) {
+		struct fwimage_part *part = & image.parts[i];
+		struct fwupgrade_action *act = find_action(part->name);
+		const char *targets[2];
+
+		if (! act) {
+			fwupgrade_cgi_status(400);
+			printf("ERROR: Unknown partition '%s' in firmware image, aborting.\n",
+			       part->name);
+			goto error;
+		}
+
+		/* Either partition may be the inactive one */
+		targets[0] = act->kernel_part1;
+		targets[1] = act->kernel_part2;
+
+		for (j = 0; j < 2; j++) {
+			int64_t size;
+
+			if (! targets[j])
+				continue;
+
+			size = flash_part_size(targets[j], act->type == TYPE_UBI);
+			if (size >= 0 && part->length > size) {
+				fwupgrade_cgi_status(400);
+				printf("ERROR: Part %s does not fit in partition %s, aborting.\n",
+				       part->name, targets[j]);
+				goto error;
+			}
+		}
+	}
+
+	fwimage_release(& image);
+	fwupgrade_cgi_status(200);
+
+	return 0;
+
+error:
+	fwimage_release(& image);
+	return -1;
+}
+
+/*
+ * Give the kernel a hint about how the data of a part is going to be
+ * accessed. Only the parts of images built with fwupgrade-tool -a
+ * start on a page boundary, the others are left alone.
+ */
+static void advise_part(const char *data, const struct fwimage_part *part,
+			int advice)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if ((uintptr_t) (data + part->offset) % pagesize)
+		return;
+
+	madvise((void *) (data + part->offset), part->length, advice);
+}
+
+int apply_upgrade(const char *data, size_t data_length)
+{
+	int i, ret;
+	struct fwimage image;
+
+	ret = fwimage_parse(data, data_length, & image);
+	if (ret) {
+		printf("ERROR: %s, aborting.\n", fwimage_strerror(ret));
 		return -1;
 	}
 
+	if (image.size > data_length) {
+		printf("ERROR: %s, aborting.\n",
+		       fwimage_strerror(FWIMAGE_ETRUNC));
+		goto error;
+	}
+
+	if (check_image_header(data, data_length))
+		goto error;
+
 	/* First loop to verify the CRC */
-	for (i = 0; i < FWPART_COUNT; i++) {
-		unsigned int sz, offset;
-		char computed_crc[FWPART_CRC_SZ];
+	for (i = 0; i < image.part_count; i++) {
+		struct fwimage_part *part = & image.parts[i];
+		unsigned char computed_crc[FWPART_CRC_SZ];
+		struct MD5Context ctx;
+		uint64_t done, n;
 
-		sz = le32toh(header->parts[i].length);
-		if (! sz)
-			continue;
+		printf("Checking part %s\n", part->name);
+		fwupgrade_progress_stage("verify", part->name, NULL,
+					 part->length);
 
-		printf("Checking part %s\n", header->parts[i].name);
+		advise_part(data, part, MADV_SEQUENTIAL);
 
-		offset = le32toh(header->parts[i].offset);
+		MD5Init(& ctx);
+		for (done = 0; done < part->length; done += n) {
+			n = part->length - done;
+			if (n > FLASH_CHUNK_SZ)
+				n = FLASH_CHUNK_SZ;
+			MD5Update(& ctx, (const unsigned char *) data +
+				  part->offset + done, n);
+			fwupgrade_progress_add(n);
+		}
+		MD5Final(computed_crc, & ctx);
 
-		md5(data + offset, sz, computed_crc);
-		if (memcmp(computed_crc, header->parts[i].crc, FWPART_CRC_SZ)) {
+		if (memcmp(computed_crc, part->crc, FWPART_CRC_SZ)) {
 			printf("ERROR: Invalid CRC in firmware image part %s\n",
-			       header->parts[i].name);
-			return -1;
+			       part->name);
+			goto error;
 		}
 	}
 
 	ret = fw_env_open();
 	if (ret) {
 		printf("ERROR: Cannot read the U-Boot environment, aborting.\n");
-		return -1;
+		goto error;
 	}
 
 	/* Second loop to actually apply the upgrade */
-	for (i = 0; i < FWPART_COUNT; i++) {
-		unsigned int sz, offset;
-		int ret;
-
-		sz = le32toh(header->parts[i].length);
-		if (! sz)
-			continue;
-
-		printf("Applying part %s\n", header->parts[i].name);
+	for (i = 0; i < image.part_count; i++) {
+		struct fwimage_part *part = & image.parts[i];
 
-		offset = le32toh(header->parts[i].offset);
+		printf("Applying part %s\n", part->name);
 
-		ret = handle_fwpart(header->parts[i].name, data + offset, sz);
+		ret = handle_fwpart(part->name, data + part->offset,
+				    part->length);
 		if (ret)
-			return ret;
+			goto error;
 	}
 
+	fwimage_release(& image);
+
 	ret = fw_env_close();
 	if (ret) {
 		printf("ERROR: Could not rewrite U-Boot environment, aborting\n");
@@ -203,6 +396,714 @@ int apply_upgrade(const char *data, unsigned int data_length)
 	}
 
 	return 0;
+
+error:
+	fwimage_release(& image);
+	return -1;
+}
+
+/* A U-Boot variable to set once every part has been flashed */
+struct env_update {
+	char        varname[64];
+	const char *value;
+};
+
+/* Switch the U-Boot environment to the newly flashed partitions */
+static int switch_env(const struct env_update *env, unsigned int count)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < count; i++)
+		fw_env_write((char *) env[i].varname, (char *) env[i].value);
+
+	ret = fw_env_close();
+	if (ret)
+		printf("ERROR: Could not rewrite U-Boot environment, aborting\n");
+
+	return ret;
+}
+
+/*
+ * Streaming upgrade, for images received over a pipe that are never
+ * held in memory as a whole. The data is fed in pieces of any size:
+ * the header is gathered and validated first, then each part is
+ * written to its inactive partition while its MD5 is computed. The
+ * U-Boot environment only switches to the new partitions once every
+ * part has been flashed and verified, so an interrupted or corrupted
+ * upload leaves the running system untouched.
+ */
+struct upgrade_stream {
+	char                 *header;
+	size_t                header_len;   /* bytes of header received */
+	size_t                header_need;  /* bytes of header expected */
+	int                   header_done;
+	struct fwimage        image;
+	unsigned int         *order;        /* part indexes by offset */
+	unsigned int          next;         /* in order[] */
+	uint64_t              pos;          /* image offset of the next byte */
+	struct flash_writer  *writer;       /* of the part being flashed */
+	struct MD5Context     md5;
+	struct env_update    *env;          /* variables set at the end */
+	unsigned int          env_count;
+};
+
+static int upgrade_stream_header(struct upgrade_stream *st)
+{
+	unsigned int i, j, tmp;
+	uint64_t end;
+	int ret;
+
+	if (check_image_header(st->header, st->header_len))
+		return -1;
+
+	ret = fwimage_parse(st->header, st->header_len, & st->image);
+	if (ret) {
+		printf("ERROR: %s, aborting.\n", fwimage_strerror(ret));
+		return -1;
+	}
+
+	/* The parts are flashed in the order of the data, which must
+	   not overlap */
+	st->order = calloc(st->image.part_count ? st->image.part_count : 1,
+			   sizeof(unsigned int));
+	st->env = calloc(st->image.part_count ? st->image.part_count : 1,
+			 sizeof(*st->env));
+	if (! st->order || ! st->env) {
+		printf("ERROR: memory allocation problem, aborting.\n");
+		return -1;
+	}
+
+	for (i = 0; i < st->image.part_count; i++) {
+		st->order[i] = i;
+		for (j = i; j > 0 && st->image.parts[st->order[j - 1]].offset >
+			     st->image.parts[st->order[j]].offset; j--) {
+			tmp = st->order[j];
+			st->order[j] = st->order[j - 1];
+			st->order[j - 1] = tmp;
+		}
+	}
+
+	for (i = 0, end = 0; i < st->image.part_count; i++) {
+		struct fwimage_part *part = & st->image.parts[st->order[i]];
+
+		if (part->offset < end) {
+			printf("ERROR: Overlapping parts, aborting.\n");
+			return -1;
+		}
+		end = part->offset + part->length;
+	}
+
+	if (fw_env_open()) {
+		printf("ERROR: Cannot read the U-Boot environment, aborting.\n");
+		return -1;
+	}
+
+	st->header_done = 1;
+	return 0;
+}
+
+static int upgrade_stream_open_part(struct upgrade_stream *st,
+				    struct fwimage_part *part)
+{
+	struct fwupgrade_action *act;
+	const char *next_kernel_part, *next_uboot_part;
+
+	printf("Applying part %s\n", part->name);
+
+	if (prepare_fwpart(part->name, & act, & next_kernel_part,
+			   & next_uboot_part, st->env[st->env_count].varname,
+			   sizeof(st->env[st->env_count].varname)))
+		return -1;
+
+	printf("Flashing partition %s\n", next_kernel_part);
+	fwupgrade_progress_stage("flash", part->name, next_kernel_part,
+				 part->length);
+
+	if (act->type == TYPE_MTD)
+		st->writer = flash_writer_open_mtd(next_kernel_part);
+	else
+		st->writer = flash_writer_open_ubi(next_kernel_part, part->length);
+
+	if (! st->writer) {
+		printf("ERROR: Unable to flash partition %s, aborting\n",
+		       next_kernel_part);
+		return -1;
+	}
+
+	st->env[st->env_count].value = next_uboot_part;
+	MD5Init(& st->md5);
+
+	return 0;
+}
+
+static int upgrade_stream_close_part(struct upgrade_stream *st,
+				     struct fwimage_part *part)
+{
+	unsigned char computed_crc[FWPART_CRC_SZ];
+	int ret;
+
+	ret = flash_writer_close(st->writer);
+	st->writer = NULL;
+	if (ret) {
+		printf("ERROR: Unable to flash part %s, aborting\n", part->name);
+		return -1;
+	}
+
+	MD5Final(computed_crc, & st->md5);
+	if (memcmp(computed_crc, part->crc, FWPART_CRC_SZ)) {
+		printf("ERROR: Invalid CRC in firmware image part %s\n",
+		       part->name);
+		return -1;
+	}
+
+	st->env_count++;
+	st->next++;
+
+	return 0;
+}
+
+/* Feed len bytes of the image, following the previous ones */
+static int upgrade_stream_feed(void *ctx, const char *data, size_t len)
+{
+	struct upgrade_stream *st = ctx;
+	struct fwimage_part *part;
+	uint64_t n;
+	int ret;
+
+	while (len || (st->header_done && st->next < st->image.part_count &&
+		       st->pos == st->image.parts[st->order[st->next]].offset +
+		       st->image.parts[st->order[st->next]].length)) {
+		if (! st->header_done) {
+			n = st->header_need - st->header_len;
+			if (n > len)
+				n = len;
+
+			memcpy(st->header + st->header_len, data, n);
+			st->header_len += n;
+			st->pos        += n;
+			data           += n;
+			len            -= n;
+
+			if (st->header_len < st->header_need)
+				continue;
+
+			/* The fixed part of the header tells how large
+			   the whole header is */
+			ret = check_image_header(st->header, st->header_len);
+			if (ret > 0) {
+				char *tmp = realloc(st->header, ret);
+
+				if (! tmp) {
+					fwupgrade_cgi_status(500);
+					printf("ERROR: memory allocation problem, aborting.\n");
+					return -1;
+				}
+				st->header = tmp;
+				st->header_need = ret;
+				continue;
+			}
+
+			if (ret < 0 || upgrade_stream_header(st))
+				return -1;
+			continue;
+		}
+
+		/* Data after the last part is ignored */
+		if (st->next >= st->image.part_count) {
+			st->pos += len;
+			break;
+		}
+
+		part = & st->image.parts[st->order[st->next]];
+
+		/* Skip the alignment padding before the part */
+		if (st->pos < part->offset) {
+			n = part->offset - st->pos;
+			if (n > len)
+				n = len;
+			st->pos += n;
+			data    += n;
+			len     -= n;
+			continue;
+		}
+
+		if (! st->writer && upgrade_stream_open_part(st, part))
+			return -1;
+
+		n = part->offset + part->length - st->pos;
+		if (n > len)
+			n = len;
+		if (n > (1 << 30))
+			n = 1 << 30;
+
+		if (n) {
+			if (progress_write(st->writer, data, n)) {
+				printf("ERROR: Unable to flash part %s, aborting\n",
+				       part->name);
+				return -1;
+			}
+			MD5Update(& st->md5, (const unsigned char *) data, n);
+			st->pos += n;
+			data    += n;
+			len     -= n;
+		}
+
+		if (st->pos == part->offset + part->length &&
+		    upgrade_stream_close_part(st, part))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void upgrade_stream_init(struct upgrade_stream *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->header_need = sizeof(struct fwheader_v2);
+	st->header = malloc(st->header_need);
+}
+
+/*
+ * Complete a streaming upgrade once all the data has been fed: switch
+ * the U-Boot environment to the new partitions if every part was
+ * received. Also releases the stream, which can be done at any time
+ * to abort the upgrade.
+ */
+static int upgrade_stream_finish(struct upgrade_stream *st, int abort)
+{
+	int ret = -1;
+
+	if (st->writer)
+		flash_writer_abort(st->writer);
+
+	if (! abort) {
+		if (! st->header || ! st->header_done ||
+		    st->next < st->image.part_count) {
+			fwupgrade_cgi_status(400);
+			printf("ERROR: %s, aborting.\n",
+			       fwimage_strerror(FWIMAGE_ETRUNC));
+		} else
+			ret = switch_env(st->env, st->env_count);
+	}
+
+	free(st->header);
+	free(st->order);
+	free(st->env);
+	fwimage_release(& st->image);
+
+	return ret;
+}
+
+/* The fields that come before a part */
+enum {
+	FORM_FIELD_MD5,
+	FORM_FIELD_SIZE,
+};
+
+/* What the fields before a part tell about it */
+struct form_part {
+	unsigned char  md5[FWPART_CRC_SZ];
+	int            has_md5;
+	long long      size;       /* or -1 */
+	int            seen;       /* the part itself has been received */
+};
+
+/*
+ * A multipart upload. Its elements are either a whole firmware image,
+ * flashed through an upgrade stream, or single parts, named after
+ * their action in the configuration and flashed as they are received.
+ * Single parts have no header, so each one must be preceded by a
+ * <part>.md5 field with the hexadecimal MD5 of its content, checked
+ * before the environment is switched to it. A UBI part must also have
+ * its size given up front, by a <part>.size field or the Content-Length
+ * of its element, as a volume update needs it.
+ */
+struct upgrade_form {
+	struct upgrade_stream  stream;     /* of the image element */
+	int                    has_image;
+	int                    in_image;
+	char                   image_name[64];
+	const char            *part_name;  /* of the current part element */
+	const char            *target;     /* partition it is flashed to */
+	int                    type;
+	long long              length;     /* announced, or -1 */
+	int64_t                max;        /* size of the target, or -1 */
+	uint64_t               received;
+	struct flash_writer   *writer;
+	struct env_update     *env;        /* one per flashed part */
+	unsigned int           env_count;
+	struct form_part      *parts;      /* indexed like actions */
+	struct form_part      *part;       /* of the current element */
+	struct MD5Context      md5;
+	int                    in_field;   /* FORM_FIELD_*, or -1 */
+	char                   field[72];
+	size_t                 field_len;
+};
+
+/*
+ * The action of a <part>.md5 or <part>.size field, with the kind of
+ * field in kind, or NULL
+ */
+static struct fwupgrade_action *form_field_action(const char *name,
+						  int *kind)
+{
+	const char *dot = strrchr(name, '.');
+	char part[64];
+
+	if (! dot || dot - name >= sizeof(part))
+		return NULL;
+
+	if (! strcmp(dot, ".md5"))
+		*kind = FORM_FIELD_MD5;
+	else if (! strcmp(dot, ".size"))
+		*kind = FORM_FIELD_SIZE;
+	else
+		return NULL;
+
+	memcpy(part, name, dot - name);
+	part[dot - name] = '\0';
+
+	return find_action(part);
+}
+
+/* Parse a hexadecimal MD5, possibly followed by blanks */
+static int form_parse_md5(const char *text, unsigned char *md5)
+{
+	char byte[3] = "";
+	unsigned int i;
+
+	for (i = 0; i < FWPART_CRC_SZ; i++) {
+		if (! isxdigit((unsigned char) text[2 * i]) ||
+		    ! isxdigit((unsigned char) text[2 * i + 1]))
+			return -1;
+		memcpy(byte, text + 2 * i, 2);
+		md5[i] = strtoul(byte, NULL, 16);
+	}
+
+	for (text += 2 * FWPART_CRC_SZ; *text; text++)
+		if (! isspace((unsigned char) *text))
+			return -1;
+
+	return 0;
+}
+
+/* A field about a part, received before the part */
+static int upgrade_form_begin_field(struct upgrade_form *f,
+				    struct fwupgrade_action *act, int kind)
+{
+	if (f->has_image) {
+		fwupgrade_cgi_status(400);
+		printf("ERROR: A firmware image must be uploaded alone, aborting.\n");
+		return -1;
+	}
+
+	if (! f->parts) {
+		unsigned int i;
+
+		f->parts = calloc(action_count, sizeof(*f->parts));
+		if (! f->parts) {
+			fwupgrade_cgi_status(500);
+			printf("ERROR: memory allocation problem, aborting.\n");
+			return -1;
+		}
+		for (i = 0; i < action_count; i++)
+			f->parts[i].size = -1;
+	}
+
+	f->part = & f->parts[act - actions];
+	if (f->part->seen) {
+		fwupgrade_cgi_status(400);
+		printf("ERROR: The %s of part %s must come before it, aborting.\n",
+		       kind == FORM_FIELD_MD5 ? "digest" : "size",
+		       act->part_name);
+		return -1;
+	}
+
+	f->part_name = act->part_name;
+	f->in_field = kind;
+	f->field_len = 0;
+
+	return 0;
+}
+
+static int upgrade_form_end_field(struct upgrade_form *f)
+{
+	char *end;
+	int kind = f->in_field;
+
+	f->field[f->field_len] = '\0';
+	f->in_field = -1;
+
+	if (kind == FORM_FIELD_SIZE) {
+		f->part->size = strtoll(f->field, & end, 10);
+		while (isspace((unsigned char) *end))
+			end++;
+		if (end == f->field || *end || f->part->size < 0) {
+			fwupgrade_cgi_status(400);
+			printf("ERROR: Invalid size for part %s, aborting.\n",
+			       f->part_name);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (form_parse_md5(f->field, f->part->md5)) {
+		fwupgrade_cgi_status(400);
+		printf("ERROR: Invalid digest for part %s, aborting.\n",
+		       f->part_name);
+		return -1;
+	}
+	f->part->has_md5 = 1;
+
+	return 0;
+}
+
+static int upgrade_form_begin(void *ctx, const char *name,
+			      const char *filename, long long length)
+{
+	struct upgrade_form *f = ctx;
+	struct fwupgrade_action *act;
+	struct env_update *env;
+	unsigned int i;
+	int kind;
+
+	f->received = 0;
+
+	act = form_field_action(name, & kind);
+	if (act)
+		return upgrade_form_begin_field(f, act, kind);
+
+	if (! find_action(name)) {
+		if (f->has_image || f->env_count || f->parts) {
+			fwupgrade_cgi_status(400);
+			printf("ERROR: A firmware image must be uploaded alone, aborting.\n");
+			return -1;
+		}
+
+		snprintf(f->image_name, sizeof(f->image_name), "%s",
+			 filename ? filename : name);
+		upgrade_stream_init(& f->stream);
+		f->has_image = 1;
+		f->in_image = 1;
+		return 0;
+	}
+
+	if (f->has_image) {
+		fwupgrade_cgi_status(400);
+		printf("ERROR: A firmware image must be uploaded alone, aborting.\n");
+		return -1;
+	}
+
+	if (! f->env) {
+		f->env = calloc(action_count, sizeof(*f->env));
+		if (! f->env) {
+			fwupgrade_cgi_status(500);
+			printf("ERROR: memory allocation problem, aborting.\n");
+			return -1;
+		}
+
+		if (fw_env_open()) {
+			fwupgrade_cgi_status(500);
+			printf("ERROR: Cannot read the U-Boot environment, aborting.\n");
+			return -1;
+		}
+	}
+
+	env = & f->env[f->env_count];
+
+	if (prepare_fwpart(name, & act, & f->target, & env->value,
+			   env->varname, sizeof(env->varname))) {
+		fwupgrade_cgi_status(400);
+		return -1;
+	}
+
+	for (i = 0; i < f->env_count; i++) {
+		if (! strcmp(f->env[i].varname, env->varname)) {
+			fwupgrade_cgi_status(400);
+			printf("ERROR: Part %s uploaded twice, aborting.\n", name);
+			return -1;
+		}
+	}
+
+	f->part = f->parts ? & f->parts[act - actions] : NULL;
+	if (! f->part || ! f->part->has_md5) {
+		fwupgrade_cgi_status(400);
+		printf("ERROR: No digest for part %s, send a %s.md5 field before it, aborting.\n",
+		       name, name);
+		return -1;
+	}
+	f->part->seen = 1;
+	MD5Init(& f->md5);
+
+	if (length >= 0 && f->part->size >= 0 && length != f->part->size) {
+		fwupgrade_cgi_status(400);
+		printf("ERROR: Part %s does not have the size given for it, aborting.\n",
+		       name);
+		return -1;
+	}
+	if (length < 0)
+		length = f->part->size;
+
+	/* A UBI volume update needs the size up front */
+	if (act->type == TYPE_UBI && length < 0) {
+		fwupgrade_cgi_status(411);
+		printf("ERROR: No size for UBI part %s, send a %s.size field before it, aborting.\n",
+		       name, name);
+		return -1;
+	}
+
+	f->part_name = act->part_name;
+	f->type = act->type;
+	f->length = length;
+	f->max = flash_part_size(f->target, act->type == TYPE_UBI);
+
+	if (f->max >= 0 && length > f->max) {
+		fwupgrade_cgi_status(400);
+		printf("ERROR: Part %s does not fit in partition %s, aborting.\n",
+		       name, f->target);
+		return -1;
+	}
+
+	fwupgrade_cgi_status(200);
+	printf("Applying part %s\n", name);
+	printf("Flashing partition %s\n", f->target);
+	fwupgrade_progress_stage("flash", name, f->target,
+				 length >= 0 ? length : 0);
+
+	if (act->type == TYPE_MTD)
+		f->writer = flash_writer_open_mtd(f->target);
+	else
+		f->writer = flash_writer_open_ubi(f->target, length);
+
+	if (! f->writer) {
+		printf("ERROR: Unable to flash partition %s, aborting\n",
+		       f->target);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int upgrade_form_data(void *ctx, const char *data, size_t len)
+{
+	struct upgrade_form *f = ctx;
+
+	if (f->in_image) {
+		f->received += len;
+		return upgrade_stream_feed(& f->stream, data, len);
+	}
+
+	if (f->in_field >= 0) {
+		if (f->field_len + len >= sizeof(f->field)) {
+			fwupgrade_cgi_status(400);
+			printf("ERROR: Invalid %s for part %s, aborting.\n",
+			       f->in_field == FORM_FIELD_MD5 ? "digest" : "size",
+			       f->part_name);
+			return -1;
+		}
+		memcpy(f->field + f->field_len, data, len);
+		f->field_len += len;
+		return 0;
+	}
+
+	if ((f->length >= 0 && f->received + len > (uint64_t) f->length) ||
+	    (f->max >= 0 && f->received + len > (uint64_t) f->max)) {
+		printf("ERROR: Part %s is too large, aborting.\n",
+		       f->part_name);
+		return -1;
+	}
+
+	if (progress_write(f->writer, data, len)) {
+		printf("ERROR: Unable to flash part %s, aborting\n",
+		       f->part_name);
+		return -1;
+	}
+
+	MD5Update(& f->md5, (const unsigned char *) data, len);
+	f->received += len;
+
+	return 0;
+}
+
+static int upgrade_form_end(void *ctx)
+{
+	struct upgrade_form *f = ctx;
+	unsigned char computed_crc[FWPART_CRC_SZ];
+	int ret;
+
+	if (f->in_image) {
+		f->in_image = 0;
+		if (f->stream.header_done)
+			printf("Received image file '%s' of %llu bytes\n",
+			       f->image_name, (unsigned long long) f->received);
+		return 0;
+	}
+
+	if (f->in_field >= 0)
+		return upgrade_form_end_field(f);
+
+	if (f->length >= 0 && f->received != (uint64_t) f->length) {
+		printf("ERROR: Part %s is truncated, aborting.\n", f->part_name);
+		return -1;
+	}
+
+	ret = flash_writer_close(f->writer);
+	f->writer = NULL;
+	if (ret) {
+		printf("ERROR: Unable to flash part %s, aborting\n",
+		       f->part_name);
+		return -1;
+	}
+
+	/* The environment is left alone unless every part matches */
+	MD5Final(computed_crc, & f->md5);
+	if (memcmp(computed_crc, f->part->md5, FWPART_CRC_SZ)) {
+		printf("ERROR: Invalid CRC in firmware part %s\n", f->part_name);
+		return -1;
+	}
+
+	f->env_count++;
+
+	return 0;
+}
+
+static const struct fwupgrade_cgi_element_ops upgrade_form_ops = {
+	.begin = upgrade_form_begin,
+	.data  = upgrade_form_data,
+	.end   = upgrade_form_end,
+};
+
+/*
+ * Receive and flash a multipart upload, then switch the U-Boot
+ * environment if every element was flashed
+ */
+static int upgrade_form(void)
+{
+	struct upgrade_form f;
+	int ret;
+
+	memset(& f, 0, sizeof(f));
+	f.in_field = -1;
+
+	ret = fwupgrade_cgi_receive_multipart(& upgrade_form_ops, & f);
+
+	if (f.writer)
+		flash_writer_abort(f.writer);
+
+	if (f.has_image)
+		ret = upgrade_stream_finish(& f.stream, ret);
+	else if (! ret && ! f.env_count) {
+		fwupgrade_cgi_status(400);
+		printf("ERROR: No part in the upload, aborting.\n");
+		ret = -1;
+	} else if (! ret)
+		ret = switch_env(f.env, f.env_count);
+
+	free(f.env);
+	free(f.parts);
+
+	return ret;
 }
 
 int parse_configuration(void)
@@ -214,8 +1115,6 @@ int parse_configuration(void)
 	if (! cfg)
 		return -1;
 
-	memset(actions, 0, sizeof(actions));
-
 	while (fgets(line, sizeof(line), cfg)) {
 		char *tmp, *cur;
 		enum { FIELD_PART_NAME,
@@ -225,11 +1124,17 @@ int parse_configuration(void)
 		       FIELD_KERNEL_PART2,
 		       FIELD_TYPE} field = FIELD_PART_NAME;
 
-		if (action >= FWPART_COUNT) {
+		struct fwupgrade_action *tmpactions;
+
+		tmpactions = realloc(actions, (action + 1) * sizeof(*actions));
+		if (! tmpactions) {
 			fclose(cfg);
 			return -1;
 		}
 
+		actions = tmpactions;
+		memset(& actions[action], 0, sizeof(*actions));
+
 		/* In case the partition type is not defined, assume
 		 * MTD by default, for backward compatibility */
 		actions[action].type = TYPE_MTD;
@@ -262,6 +1167,7 @@ int parse_configuration(void)
 		}
 
 		action++;
+		action_count = action;
 	}
 
 	fclose(cfg);
@@ -269,13 +1175,226 @@ int parse_configuration(void)
 	return 0;
 }
 
+/*
+ * Make sure that no other upgrade runs, before anything is flashed or
+ * even received. The lock is held until the process exits, so that a
+ * crashed upgrade does not leave it behind. Returns 0 once it is
+ * taken, -1 if another upgrade holds it, or -2 on error.
+ */
+static int lock_upgrade(void)
+{
+	int fd, ret;
+
+	fd = open(FWUPGRADE_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -2;
+
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		ret = errno == EWOULDBLOCK ? -1 : -2;
+		close(fd);
+		return ret;
+	}
+
+	return 0;
+}
+
+/* Report the outcome of an upgrade, and reboot into the new system */
+static int finish_upgrade(int ret, int ascgi)
+{
+	fwupgrade_progress_finish(ret);
+	fwupgrade_progress_close();
+
+	if (ret) {
+		if (ascgi)
+			fwupgrade_cgi_status(500);
+		printf("The system upgrade failed\n");
+		if (ascgi) {
+			fflush(stdout);
+			close(STDOUT_FILENO);
+		}
+		return -1;
+	} else {
+		if (ascgi)
+			fwupgrade_cgi_status(200);
+		printf("The system upgrade completed successfully\n");
+		if (ascgi) {
+			/* Also the end of the response for a daemon
+			   connection, which stdin shares */
+			fflush(stdout);
+			close(STDOUT_FILENO);
+			close(STDIN_FILENO);
+		}
+		sync();
+		sleep(1);
+		reboot(LINUX_REBOOT_CMD_RESTART);
+	}
+
+	return 0;
+}
+
+/* Receive an image from the HTTP request and apply it */
+static int serve_request(void)
+{
+	char *data, *method;
+	size_t data_length;
+	int ret;
+
+	if (fwupgrade_progress_request())
+		return fwupgrade_progress_serve();
+
+	/* A second upload is turned down before its body is read. Only
+	   the query of an upload session can go on. */
+	method = getenv("REQUEST_METHOD");
+	if (! method || strcasecmp(method, "get")) {
+		ret = lock_upgrade();
+		if (ret == -1) {
+			fwupgrade_cgi_status(409);
+			printf("ERROR: another upgrade is in progress, aborting.\n");
+			return -1;
+		}
+		if (ret) {
+			fwupgrade_cgi_status(500);
+			printf("ERROR: cannot lock %s, aborting.\n", FWUPGRADE_LOCK);
+			return -1;
+		}
+	}
+
+	if (fwupgrade_session_id()) {
+		char path[PATH_MAX];
+
+		/* A piece of a resumable upload, the image is applied
+		   once it is complete */
+		ret = fwupgrade_session_receive(check_image_header,
+						path, sizeof(path));
+		if (ret <= 0)
+			return ret;
+
+		fwupgrade_progress_open();
+		data = fwupgrade_load_file_data(path, & data_length);
+		ret = data ? apply_upgrade(data, data_length) : -1;
+		unlink(path);
+	} else if (fwupgrade_cgi_raw_upload()) {
+		struct upgrade_stream st;
+
+		/* The raw image is flashed while it is received */
+		fwupgrade_progress_open();
+		upgrade_stream_init(& st);
+		ret = fwupgrade_cgi_receive_stream(upgrade_stream_feed, & st);
+		ret = upgrade_stream_finish(& st, ret);
+	} else {
+		/* So are the elements of a form */
+		fwupgrade_progress_open();
+		ret = upgrade_form();
+	}
+
+	return finish_upgrade(ret, 1);
+}
+
+/* A request on a daemon connection, answered in plain HTTP */
+static int serve_daemon_request(void)
+{
+	fwupgrade_cgi_init(1);
+	return serve_request();
+}
+
+/*
+ * Read the bad block maps of the MTD partitions that may be flashed,
+ * for the daemon children to inherit
+ */
+static void scan_bad_blocks(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < action_count && actions[i].part_name; i++) {
+		if (actions[i].type != TYPE_MTD)
+			continue;
+		if (actions[i].kernel_part1)
+			flash_bbt_scan(actions[i].kernel_part1);
+		if (actions[i].kernel_part2)
+			flash_bbt_scan(actions[i].kernel_part2);
+	}
+}
+
+static void daemon_help(void)
+{
+	fprintf(stderr, "fwupgraded, serve firmware upgrades\n");
+	fprintf(stderr, " usage: fwupgraded [-s socket] [-p port [-a address]]\n");
+	fprintf(stderr, "  -s socket : Unix socket used by fwupgrade-cgi (default %s)\n",
+		FWUPGRADE_SOCKET);
+	fprintf(stderr, "  -p port   : also answer HTTP requests on this TCP port, without any authentication\n");
+	fprintf(stderr, "  -a address: IPv4 address of the TCP port (default %s)\n",
+		FWUPGRADE_DAEMON_ADDRESS);
+}
+
+static int run_daemon(int argc, char *argv[])
+{
+	const char *socket_path = FWUPGRADE_SOCKET;
+	const char *address = FWUPGRADE_DAEMON_ADDRESS;
+	int port = 0, opt;
+
+	while ((opt = getopt(argc, argv, "hs:p:a:")) != -1) {
+		switch (opt) {
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'a':
+			address = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			if (port <= 0 || port > 65535) {
+				fprintf(stderr, "Invalid port %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'h':
+			daemon_help();
+			return 0;
+		default:
+			daemon_help();
+			return -1;
+		}
+	}
+
+	if (fw_env_load_config()) {
+		fprintf(stderr, "Problem parsing U-Boot environment configuration\n");
+		return -1;
+	}
+
+	scan_bad_blocks();
+
+	return fwupgrade_daemon_run(socket_path, address, port,
+				    serve_daemon_request,
+				    scan_bad_blocks) ? -1 : 0;
+}
+
+static void file_help(void)
+{
+	fprintf(stderr, "fwupgrade, apply a firmware image\n");
+	fprintf(stderr, " usage: fwupgrade [-s socket] image\n");
+	fprintf(stderr, "        fwupgrade [-s socket] [-j connections] --url http://...\n");
+	fprintf(stderr, "  -s socket     : report the progress as JSON lines to the clients of this Unix socket\n");
+	fprintf(stderr, "  -u, --url url : download the image, flashing it while it is received\n");
+	fprintf(stderr, "  -j connections: number of parallel range requests of a download (default %d)\n",
+		FWUPGRADE_HTTP_CONNECTIONS);
+}
+
+static const struct option file_options[] = {
+	{ "url",         required_argument, NULL, 'u' },
+	{ "connections", required_argument, NULL, 'j' },
+	{ "help",        no_argument,       NULL, 'h' },
+	{ NULL,          0,                 NULL, 0 },
+};
+
 int main(int argc, char *argv[])
 {
+	const char *progress_socket = NULL, *url = NULL;
+	unsigned int connections = FWUPGRADE_HTTP_CONNECTIONS;
 	char *data;
-	unsigned int data_length;
-	int ret;
+	size_t data_length;
+	int ret, opt;
 	char *execname = basename(argv[0]);
-	int ascgi;
+	enum { MODE_FILE, MODE_CGI, MODE_DAEMON } mode;
 
 	if (! execname) {
 		fprintf(stderr, "No executable name\n");
@@ -283,9 +1402,11 @@ int main(int argc, char *argv[])
 	}
 
 	if (! strcmp(execname, "fwupgrade"))
-		ascgi = 0;
+		mode = MODE_FILE;
 	else if (! strcmp(execname, "fwupgrade-cgi"))
-		ascgi = 1;
+		mode = MODE_CGI;
+	else if (! strcmp(execname, "fwupgraded"))
+		mode = MODE_DAEMON;
 	else {
 		fprintf(stderr, "Unknown executable name %s\n", execname);
 		return -1;
@@ -295,45 +1416,106 @@ int main(int argc, char *argv[])
 	 * messages are sent to the HTTP client right away */
 	setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
 
-	if (ascgi)
-		printf("Content-type: text/plain\n\n");
+	if (mode == MODE_CGI) {
+		/* When the daemon runs, the CGI only relays the request
+		   to it */
+		ret = fwupgrade_daemon_forward(FWUPGRADE_SOCKET);
+		if (ret >= 0)
+			return ret;
+
+		/* The CGI response headers are sent once the beginning
+		   of the image has been checked, so that invalid images
+		   are rejected with an error status */
+		fwupgrade_cgi_init(0);
+	}
 
 	ret = parse_configuration();
 	if (ret < 0) {
-		fprintf(stderr, "Problem parsing configuration\n");
+		if (mode == MODE_CGI) {
+			fwupgrade_cgi_status(500);
+			printf("ERROR: Problem parsing configuration, aborting.\n");
+		} else
+			fprintf(stderr, "Problem parsing configuration\n");
 		return -1;
 	}
 
-	if (ascgi) {
-		data = fwupgrade_cgi_receive_data(& data_length);
-		if (! data) {
-			printf("Failed to receive data\n");
-			return -1;
-		}
-	} else {
-		data = fwupgrade_load_file_data(argv[1], & data_length);
-		if (! data) {
-			fprintf(stderr, "Failed to load data\n");
+	if (mode == MODE_DAEMON)
+		return run_daemon(argc, argv);
+
+	if (mode == MODE_CGI)
+		return serve_request();
+
+	while ((opt = getopt_long(argc, argv, "hs:u:j:", file_options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			progress_socket = optarg;
+			break;
+		case 'u':
+			url = optarg;
+			break;
+		case 'j':
+			connections = atoi(optarg);
+			if (connections < 1 ||
+			    connections > FWUPGRADE_HTTP_MAX_CONNECTIONS) {
+				fprintf(stderr, "Invalid number of connections %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'h':
+			file_help();
+			return 0;
+		default:
+			file_help();
 			return -1;
 		}
 	}
 
-	ret = apply_upgrade(data, data_length);
+	if (! url && optind >= argc) {
+		file_help();
+		return -1;
+	}
+
+	ret = lock_upgrade();
+	if (ret == -1) {
+		fprintf(stderr, "Another upgrade is in progress\n");
+		return -1;
+	}
 	if (ret) {
-		printf("The system upgrade failed\n");
-		if (ascgi)
-			close(STDOUT_FILENO);
+		fprintf(stderr, "Cannot lock %s\n", FWUPGRADE_LOCK);
 		return -1;
-	} else {
-		printf("The system upgrade completed successfully\n");
-		if (ascgi) {
-			fflush(stdout);
-			close(STDOUT_FILENO);
-		}
-		sync();
-		sleep(1);
-		reboot(LINUX_REBOOT_CMD_RESTART);
 	}
 
-	return 0;
+	if (url) {
+		struct upgrade_stream st;
+
+		fwupgrade_progress_open();
+		if (progress_socket &&
+		    fwupgrade_progress_listen(progress_socket))
+			return -1;
+
+		/* Each part is flashed while the next ones are being
+		   downloaded */
+		upgrade_stream_init(& st);
+		ret = fwupgrade_http_pull(url, connections,
+					  upgrade_stream_feed, & st);
+		ret = upgrade_stream_finish(& st, ret);
+
+		return finish_upgrade(ret, 0);
+	}
+
+	data = fwupgrade_load_file_data(argv[optind], & data_length);
+	if (! data) {
+		fprintf(stderr, "Failed to load data\n");
+		return -1;
+	}
+
+	fwupgrade_progress_open();
+	if (progress_socket && fwupgrade_progress_listen(progress_socket))
+		return -1;
+
+	ret = apply_upgrade(data, data_length);
+
+	return finish_upgrade(ret, 0);
 }
@@ -2,6 +2,7 @@
 #define FWUPGRADE_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define FWPART_NAME_SZ 16
 #define FWPART_CRC_SZ  16
@@ -37,9 +38,59 @@ struct fwheader {
 	unsigned int  hwid;
 	unsigned int  flags;
 	struct fwpart parts[FWPART_COUNT];
-	char          unused[1012];
+
+	/* Alignment of the part offsets, 0 if they are not aligned */
+	unsigned int  align;
+	char          unused[1008];
 };
 
-void md5 (const char *input, int len, char output[16]);
+#define FWUPGRADE_MAGIC_V2 0x5E7F2902
+
+/* Structure describing one part of a version 2 firmware image. */
+struct fwpart_v2 {
+	/* 0-terminated string */
+	char         name[FWPART_NAME_SZ];
+
+	/* MD5SUM of the part data */
+	char         crc[FWPART_CRC_SZ];
+
+	/* Size of the part, in bytes */
+	uint64_t     length;
+
+	/* Offset of the part, in bytes, from the beginning of the
+	   file */
+	uint64_t     offset;
+
+	/* Pad the structure so that it takes 128 bytes, like struct
+	   fwpart */
+	char         unused[80];
+};
+
+/* Header of a version 2 firmware image. It is followed by part_count
+   struct fwpart_v2, then by the data of the parts. We pad it so that
+   the structure takes 64 bytes, for future extensions */
+struct fwheader_v2 {
+	uint32_t      magic;
+	uint32_t      hwid;
+	uint32_t      flags;
+	uint32_t      part_count;
+
+	/* Alignment of the part offsets, 0 if they are not aligned */
+	uint32_t      align;
+	char          unused[44];
+};
+
+struct MD5Context {
+	uint32_t buf[4];
+	uint32_t bits[2];
+	unsigned char in[64];
+};
+
+/* Incremental MD5, for data that is not available all at once */
+void MD5Init(struct MD5Context *ctx);
+void MD5Update(struct MD5Context *ctx, unsigned char const *buf, unsigned len);
+void MD5Final(unsigned char digest[16], struct MD5Context *ctx);
+
+void md5 (const char *input, size_t len, char output[16]);
 
 #endif /* FWUPGRADE_H */
@@ -27,12 +27,9 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 
-struct MD5Context {
-        uint32_t buf[4];
-        uint32_t bits[2];
-        unsigned char in[64];
-};
+#include "fwupgrade.h"
 
 static void
 MD5Transform(uint32_t buf[4], uint32_t const in[16]);
@@ -56,7 +53,7 @@ byteReverse(unsigned char *buf, unsigned longs)
  * Start MD5 accumulation.  Set bit count to 0 and buffer to mysterious
  * initialization constants.
  */
-static void
+void
 MD5Init(struct MD5Context *ctx)
 {
 	ctx->buf[0] = 0x67452301;
@@ -72,7 +69,7 @@ MD5Init(struct MD5Context *ctx)
  * Update context to reflect the concatenation of another buffer full
  * of bytes.
  */
-static void
+void
 MD5Update(struct MD5Context *ctx, unsigned char const *buf, unsigned len)
 {
 	register uint32_t t;
@@ -121,7 +118,7 @@ MD5Update(struct MD5Context *ctx, unsigned char const *buf, unsigned len)
  * Final wrapup - pad to 64-byte boundary with the bit pattern
  * 1 0* (64-bit count of bits processed, MSB-first)
  */
-static void
+void
 MD5Final(unsigned char digest[16], struct MD5Context *ctx)
 {
 	unsigned int count;
@@ -269,11 +266,21 @@ MD5Transform(uint32_t buf[4], uint32_t const in[16])
  * 'input'. 'output' must have enough space to hold 16 bytes.
  */
 void
-md5 (const char *input, int len, char output[16])
+md5 (const char *input, size_t len, char output[16])
 {
 	struct MD5Context context;
 
 	MD5Init(&context);
-	MD5Update(&context, (const unsigned char *) input, len);
+
+	/* MD5Update() takes an unsigned length, feed it with chunks
+	   of at most 1 GB */
+	while (len) {
+		unsigned chunk = len > (1 << 30) ? (1 << 30) : len;
+
+		MD5Update(&context, (const unsigned char *) input, chunk);
+		input += chunk;
+		len   -= chunk;
+	}
+
 	MD5Final((unsigned char *)output, &context);
 }